@@ -203,6 +203,94 @@ private:
 
 // =============
 
+struct RayHit
+{
+	glm::ivec3 cube;
+	int face; // face of <cube> through which ray entered it (as in Cube::faces: xmin, xmax, ymin, ymax, zmin, zmax)
+	float distance; // along ray, to entry point
+};
+
+// Moves ray to the first voxel outside of aligned cube of size 2^<bits> containing <pos>, as if it was stepped voxel by voxel.
+// <crossing> is ray distance to next voxel boundary on each axis, <dd> is ray distance between boundaries.
+// Returns axis of the boundary the ray leaves through, or -1 if exit is further than <max_dist>.
+inline int ray_skip_cell(glm::ivec3& pos, glm::vec3& crossing, glm::ivec3 id, glm::vec3 dd, int bits, float max_dist)
+{
+	int mask = (1 << bits) - 1;
+	glm::ivec3 steps; // boundaries to cross on each axis to leave cell
+	glm::vec3 exit;
+	FOR(i, 3)
+	{
+		steps[i] = (id[i] > 0) ? mask - (pos[i] & mask) + 1 : (pos[i] & mask) + 1;
+		exit[i] = (steps[i] == 1) ? crossing[i] : crossing[i] + (steps[i] - 1) * dd[i];
+	}
+	int a = (exit.x < exit.y) ? (exit.x < exit.z ? 0 : 2) : (exit.y < exit.z ? 1 : 2);
+	float t = exit[a];
+	if (t > max_dist) return -1;
+
+	FOR(i, 3)
+	{
+		// Boundaries on other axes crossed before exit (staying inside cell)
+		int k = (i == a) ? steps[i] : (crossing[i] < t ? std::min<int>(std::ceil((t - crossing[i]) / dd[i]), steps[i] - 1) : 0);
+		if (k == 0) continue;
+		pos[i] += id[i] * k;
+		crossing[i] += dd[i] * k;
+	}
+	return a;
+}
+
+// Exact voxel traversal (Amanatides & Woo) of ray <orig> + <dir> * t for t up to <max_dist>.
+// Calls hit(cube) for every cube the ray enters, in order, until it returns true. Cube containing <orig> is skipped.
+// skip(cube) returns <bits> of an aligned empty cube of size 2^<bits> around <cube> (or 0), which is then crossed in one step.
+template<typename Hit, typename Skip>
+bool raycast_voxels(glm::vec3 orig, glm::vec3 dir, float max_dist, const Hit& hit, const Skip& skip, RayHit& result)
+{
+	glm::ivec3 cube = glm::ivec3(glm::floor(orig));
+	glm::ivec3 step;
+	glm::vec3 t_max, t_delta;
+	FOR(i, 3)
+	{
+		if (dir[i] == 0)
+		{
+			step[i] = 0;
+			t_max[i] = t_delta[i] = INFINITY;
+			continue;
+		}
+		step[i] = (dir[i] > 0) ? 1 : -1;
+		t_delta[i] = std::abs(1 / dir[i]);
+		t_max[i] = ((dir[i] > 0 ? cube[i] + 1 : cube[i]) - orig[i]) / dir[i];
+	}
+
+	while (true)
+	{
+		int axis;
+		float t;
+		int bits = skip(cube);
+		if (bits > 0)
+		{
+			axis = ray_skip_cell(cube, t_max, step, t_delta, bits, max_dist);
+			if (axis == -1) return false;
+			t = t_max[axis] - t_delta[axis];
+		}
+		else
+		{
+			axis = (t_max.x < t_max.y) ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+			t = t_max[axis];
+			if (t > max_dist) return false;
+			cube[axis] += step[axis];
+			t_max[axis] += t_delta[axis];
+		}
+		if (hit(cube))
+		{
+			result.cube = cube;
+			result.face = axis * 2 + (step[axis] > 0 ? 0 : 1);
+			result.distance = t;
+			return true;
+		}
+	}
+}
+
+// =============
+
 template<typename T>
 struct arraydeque
 {
@@ -265,8 +353,8 @@ struct arraydeque
 		if (capacity == 0) capacity = 8;
 		while (capacity < size) capacity *= 2;
 		T* array = (T*)malloc(sizeof(T) * (size_t)capacity);
-		memcpy(array, m_array + m_begin, sizeof(T) * (size_t)(m_capacity - m_begin));
-		memcpy(array + m_capacity - m_begin, m_array, sizeof(T) * (size_t)m_begin);
+		std::copy(m_array + m_begin, m_array + m_capacity, array);
+		std::copy(m_array, m_array + m_begin, array + m_capacity - m_begin);
 		free(m_array);
 		m_begin = 0;
 		m_end = m_capacity;
@@ -1,5 +1,10 @@
 #include "ply_io.h"
 #include <unordered_map>
+#include <condition_variable>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "util.hh"
 #include "algorithm.hh"
@@ -9,6 +14,7 @@
 #include "socket.hh"
 #include "parse.hh"
 #include "message.hh"
+#include "physics.hh"
 
 #define LODEPNG_COMPILE_CPP
 #include "lodepng/lodepng.h"
@@ -63,133 +69,158 @@ namespace Cube
 
 // ============================
 
-struct Quad
+// Quad as generated by BlockRenderer (merged and packed to Quad afterwards)
+struct MeshQuad
 {
-	glm::u8vec3 pos[4]; // TODO: replace with x y w h
+	glm::u8vec3 pos[4]; // corners in order of Cube::faces[plane >> 8], in 1/15 of block
 	BlockTexture texture; // highest bit: isUnderwater
 	uint16_t light; // 4 bits per vertex
 	uint16_t plane; // hi byte: plane normal (face), lo byte: plane offset
 };
 
-struct WQuad
+static_assert(block_texture_count <= 1024, "");
+
+// Packed quad, as stored in GPU memory and expanded by block.geom.
+// Quad spans blocks [u0, u0 + w) x [v0, v0 + h) of its plane, except that bottom and top edges along v can be lowered
+// by 0-15 (used by partial water sides): v range in 1/15 of block is [v0 * 15 + vlo, (v0 + h) * 15 - 15 + vhi].
+// (u, v) axes are (y, z) for x faces, (x, z) for y faces and (x, y) for z faces.
+struct Quad
 {
-	glm::u16vec3 pos[4]; // TODO: replace with x y w h
-	BlockTexture texture; // highest bit: isUnderwater
-	uint16_t light; // 4 bits per vertex
-	uint16_t plane; // hi byte: plane normal (face), lo byte: plane offset
+	uint32_t word0; // light 16 | texture 10 | underwater 1 | face 3
+	uint32_t word1; // d 8 | u0 4 | v0 4 | w-1 4 | h-1 4 | vlo 4 | vhi 4 (d is plane offset in 1/15 of block)
+
+	int light() const { return word0 & 0xFFFF; }
+	BlockTexture texture() const { return BlockTexture((word0 >> 16) & 0x3FF); }
+	int face() const { return word0 >> 27; }
+	int d() const { return word1 & 0xFF; }
+	int u0() const { return (word1 >> 8) & 15; }
+	int v0() const { return (word1 >> 12) & 15; }
+	int w() const { return ((word1 >> 16) & 15) + 1; }
+	int h() const { return ((word1 >> 20) & 15) + 1; }
+	int vlo() const { return (word1 >> 24) & 15; }
+	int vhi() const { return word1 >> 28; }
+
+	// In 1/15 of block
+	glm::vec3 center() const
+	{
+		int axis = face() / 2;
+		int ua = (axis == 0) ? 1 : 0, va = (axis == 2) ? 1 : 2;
+		glm::vec3 c;
+		c[axis] = d();
+		c[ua] = (u0() * 2 + w()) * 7.5f;
+		c[va] = ((v0() * 2 + h() - 1) * 15 + vlo() + vhi()) * 0.5f;
+		return c;
+	}
 };
 
-float distance(const Quad& q, glm::vec3 e)
-{
-	glm::vec3 a(q.pos[0]), c(q.pos[2]);
-	return glm::distance2((a + c) * 0.5f, e);
-}
+static_assert(sizeof(Quad) == 8, "");
 
-bool operator<(const Quad& a, const Quad& b)
+Quad pack(const MeshQuad& m)
 {
-	if (a.texture != b.texture)
+	int face = m.plane >> 8, axis = face / 2;
+	int ua = (axis == 0) ? 1 : 0, va = (axis == 2) ? 1 : 2;
+	int umin = 255, umax = 0, vmin = 255, vmax = 0;
+	FOR(i, 4)
 	{
-		int ga = is_blended(a.texture) ? 1 : 0;
-		int gb = is_blended(b.texture) ? 1 : 0;
-		if (ga != gb) return ga < gb;
-		return a.texture < b.texture;
+		umin = std::min<int>(umin, m.pos[i][ua]);
+		umax = std::max<int>(umax, m.pos[i][ua]);
+		vmin = std::min<int>(vmin, m.pos[i][va]);
+		vmax = std::max<int>(vmax, m.pos[i][va]);
 	}
-	if (a.plane != b.plane) return a.plane < b.plane;
-	return a.light < b.light;
+	assert(umin % 15 == 0 && umax % 15 == 0);
+	int v0 = vmin / 15;
+	int h = std::max(1, (vmax - v0 * 15 + 14) / 15);
+
+	Quad q;
+	q.word0 = m.light | ((uint(m.texture) & 0x3FF) << 16) | (((uint(m.texture) >> 15) & 1) << 26) | (face << 27);
+	q.word1 = m.pos[0][axis] | ((umin / 15) << 8) | (v0 << 12) | ((umax - umin) / 15 - 1) << 16 | (h - 1) << 20;
+	q.word1 |= (vmin - v0 * 15) << 24 | uint32_t(vmax - (v0 + h - 1) * 15) << 28;
+	return q;
 }
 
+
 const float BlockRadius = sqrtf(3) / 2;
 
 struct VisibleChunks
 {
-	VisibleChunks() : m_frame(0) { set.clear_all(); }
+	VisibleChunks() : sorted_camera(INFINITY) { set.clear_all(); }
 
-	void add(glm::ivec3 v)
+	// Visible set is rebuilt by calling add() for every visible chunk between begin_update() and end_update().
+	// Chunks which stay visible keep their order from last update, so re-sorting them by distance is cheap.
+	void begin_update()
 	{
-		if (set.xset(v & MapSizeMask))
-		{
-			Element e;
-			e.cpos = v;
-			e.frame = m_frame;
-			array.push_back(e);
-		}
+		set.clear_all();
+		added.clear();
 	}
 
-	void cleanup()
+	void add(glm::ivec3 v)
 	{
-		m_reset_frame = m_frame;
-		set.clear_all();
+		if (set.xset(v & MapSizeMask)) added.push_back(v);
 	}
 
-	void sort(glm::vec3 camera, bool done)
+	void end_update(glm::vec3 camera)
 	{
 		camera -= ii * ChunkSize / 2;
 		camera /= ChunkSize;
 
-		if (done)
+		// Drop chunks which are no longer visible, and append new ones
+		old.clear_all();
+		int w = 0;
+		for (Element& e : array)
 		{
-			int i = 0;
-			while (i < array.size())
-			{
-				if (array[i].frame - m_frame <= m_reset_frame - m_frame)
-				{
-					array[i] = array.back();
-					array.pop_back();
-					continue;
-				}
-				i += 1;
-			}
+			if (!set[e.cpos & MapSizeMask]) continue;
+			old.set(e.cpos & MapSizeMask);
+			array[w++] = e;
+		}
+		array.resize(w);
+		for (glm::ivec3 v : added)
+		{
+			if (old[v & MapSizeMask]) continue;
+			Element e;
+			e.cpos = v;
+			array.push_back(e);
+		}
+		for (Element& e : array) e.distance = glm::distance2(glm::vec3(e.cpos), camera);
 
-			for (Element& e : array) e.distance = glm::distance2(glm::vec3(e.cpos), camera);
-			std::sort(array.begin(), array.end());
+		// Insertion sort of old chunks (nearly sorted already, unless camera jumped), then merge with sorted new chunks
+		if (glm::distance2(camera, sorted_camera) > 1)
+		{
+			std::sort(array.begin(), array.begin() + w);
 		}
 		else
 		{
-			for (Element& e : array) e.distance = glm::distance2(glm::vec3(e.cpos), camera);
-			std::sort(array.begin(), array.end());
-
-			// remove duplicate array entries
-			uint max_age = (m_reset_frame - m_frame + 10);
-			int w = 0;
-			for (int i = 0; i < array.size(); i++)
+			FOR2(i, 1, w - 1)
 			{
-				int j = i + 1;
-				uint frame = array[i].frame;
-				while (j < array.size() && array[i].cpos == array[j].cpos)
-				{
-					if (array[j].frame - m_frame < frame - m_frame) frame = array[j].frame;
-					j += 1;
-				}
-				if (frame - m_frame <= max_age)
+				Element e = array[i];
+				int j = i;
+				while (j > 0 && e < array[j - 1])
 				{
-					array[w].cpos = array[i].cpos;
-					array[w].frame = frame;
-					w += 1;
+					array[j] = array[j - 1];
+					j -= 1;
 				}
-				i = j - 1;
+				array[j] = e;
 			}
-			array.resize(w);
 		}
-
-		m_frame -= 1;
+		std::sort(array.begin() + w, array.end());
+		std::inplace_merge(array.begin(), array.begin() + w, array.end());
+		sorted_camera = camera;
 	}
 
 	struct Element
 	{
 		glm::ivec3 cpos;
 		float distance;
-		uint frame;
 		bool operator<(const Element& b) const { return distance > b.distance; }
 	};
 
-	Element* begin() { return &array[0]; }
+	Element* begin() { return array.data(); }
 	Element* end() { return begin() + array.size(); }
 
 private:
-	uint m_reset_frame;
-	uint m_frame;
-	BitCube<MapSize> set;
+	BitCube<MapSize> set, old;
+	std::vector<glm::ivec3> added;
 	std::vector<Element> array;
+	glm::vec3 sorted_camera; // in chunks, at last end_update()
 };
 
 struct Chunk;
@@ -198,32 +229,71 @@ bool enable_f4 = true;
 bool enable_f5 = true;
 bool enable_f6 = true;
 
-uint8_t Light(const Quad& q, int i)
+// Ambient occlusion of chunk vertices (4 bits each) for each of 6 face directions.
+// Computed lazily by BlockRenderer and invalidated around changed blocks, so remeshing doesn't re-walk neighbours.
+struct LightField
 {
-	int s = (i % 4) * 2;
-	int a = (q.light >> s) & 3;
-	return (a + 1) * 64 - 1;
-}
+	static const int N = ChunkSize + 1;
+	static const int Size = N * N * N;
 
-uint8_t Light2(const Quad& q, int i)
-{
-	int s = (i % 4) * 4;
-	int a = (q.light >> s) & 15;
-	return (a + 1) * 16 - 1;
-}
+	LightField() { invalidate_all(); }
+
+	static int index(glm::ivec3 v) { return (v.z * N + v.y) * N + v.x; }
+	bool valid(int face, int i) const { return m_valid[face][i / 64] & (1lu << (i % 64)); }
+	int get(int face, int i) const { return (m_light[face][i / 2] >> ((i % 2) * 4)) & 15; }
+
+	void set(int face, int i, int light)
+	{
+		int s = (i % 2) * 4;
+		m_light[face][i / 2] = (m_light[face][i / 2] & ~(15 << s)) | (light << s);
+		m_valid[face][i / 64] |= 1lu << (i % 64);
+	}
+
+	void invalidate_all() { memset(m_valid, 0, sizeof(m_valid)); }
+
+	// Vertices in [min, max] (inclusive)
+	void invalidate(glm::ivec3 min, glm::ivec3 max)
+	{
+		FOR2(z, min.z, max.z) FOR2(y, min.y, max.y) FOR2(x, min.x, max.x)
+		{
+			int i = index(glm::ivec3(x, y, z));
+			FOR(f, 6) m_valid[f][i / 64] &= ~(1lu << (i % 64));
+		}
+	}
+
+private:
+	uint8_t m_light[6][(Size + 1) / 2];
+	uint64_t m_valid[6][(Size + 63) / 64];
+};
 
 struct BlockRenderer
 {
-	std::vector<Quad>* m_quads;
-	std::vector<Quad> m_quadsp;
+	std::vector<MeshQuad>* m_quads;
+	std::vector<MeshQuad> m_quadsp;
 	glm::ivec3 m_pos;
 	Block m_block;
 
-	std::vector<Quad> m_xy, m_yx;
+	std::vector<MeshQuad> m_merged;
+
+	struct MergeGroup
+	{
+		uint64_t key;
+		MeshQuad first; // template for merged quads
+		int lo, hi; // V range within cell, in 1/15 of block
+		uint16_t mask[ChunkSize]; // bit x of row y = cell (x, y)
+	};
+	std::vector<MergeGroup> m_groups;
+	std::vector<uint> m_group_table; // open addressing, index + 1 into m_groups
 
 	// V1
-	glm::ivec3 m_cxpos;
-	const Blocks** m_chunks; // 3x3x3 cube
+	// Copy of the chunk and 2 blocks of its neighbours (ambient occlusion in face_light2 looks 2 blocks away)
+	static const int Pad = 2, PaddedSize = ChunkSize + Pad * 2;
+	Block m_padded[PaddedSize * PaddedSize * PaddedSize];
+	// Bitmasks of padded rows along X, indexed [z][y]
+	uint32_t m_solid[PaddedSize][PaddedSize];
+	uint32_t m_see[PaddedSize][PaddedSize];
+	uint32_t m_partial[PaddedSize][PaddedSize];
+	LightField* m_light; // optional cache
 
 	// V2
 	// Idea: if mapchunks are shifted 8 blocks on each axis then each render chunk would only depend on 2x2x2 mapchunks (8 instead of 27)
@@ -240,16 +310,53 @@ struct BlockRenderer
 		return m_mcl[b.x][b.y][b.z].get(a & ChunkSizeMask);
 	}*/
 
-	Block get(glm::ivec3 rel)
+	Block get(glm::ivec3 rel) { return get_local(m_pos + rel); }
+
+	// <a> is relative to chunk, within [-Pad, ChunkSize + Pad)
+	Block get_local(glm::ivec3 a)
+	{
+		a += Pad;
+		assert((uint)a.x < PaddedSize && (uint)a.y < PaddedSize && (uint)a.z < PaddedSize);
+		return m_padded[(a.z * PaddedSize + a.y) * PaddedSize + a.x];
+	}
+
+	void copy_neighbourhood(const Blocks* chunks[27])
 	{
-		glm::ivec3 a = m_pos + rel;
-		glm::ivec3 b = a >> ChunkSizeBits;
-		assert(-1 <= b.x && b.x <= 1);
-		assert(-1 <= b.y && b.y <= 1);
-		assert(-1 <= b.z && b.z <= 1);
-		int i = b.x*9 + b.y*3 + b.z + 13; // ((b.x+1)*3 + b.y+1)*3 + b.z+1
-		assert((uint)i < 27u);
-		return m_chunks[i] ? (*m_chunks[i])[(a + m_cxpos) & ChunkSizeMask] : Block::none;
+		// X ranges of padded row: [-Pad, 0) from -X neighbour, [0, ChunkSize) from chunk, [ChunkSize, ChunkSize + Pad) from +X neighbour
+		const int offset[3] = { ChunkSize - Pad, 0, 0 };
+		const int length[3] = { Pad, ChunkSize, Pad };
+		FOR(pz, PaddedSize) FOR(py, PaddedSize)
+		{
+			int z = pz - Pad, y = py - Pad;
+			int cz = z >> ChunkSizeBits, cy = y >> ChunkSizeBits;
+			Block* row = m_padded + (pz * PaddedSize + py) * PaddedSize;
+			Block* dest = row;
+			FOR(cx, 3)
+			{
+				const Blocks* c = chunks[(cx - 1) * 9 + cy * 3 + cz + 13];
+				if (c)
+				{
+					memcpy(dest, c->getp(glm::ivec3(offset[cx], y & ChunkSizeMask, z & ChunkSizeMask)), length[cx] * sizeof(Block));
+				}
+				else
+				{
+					std::fill(dest, dest + length[cx], Block::none);
+				}
+				dest += length[cx];
+			}
+
+			uint32_t solid = 0, see = 0, partial = 0;
+			FOR(px, PaddedSize)
+			{
+				Block b = row[px];
+				solid |= uint32_t(b != Block::none) << px;
+				see |= uint32_t(can_see_through(b)) << px;
+				partial |= uint32_t(is_water_partial(b)) << px;
+			}
+			m_solid[pz][py] = solid;
+			m_see[pz][py] = see;
+			m_partial[pz][py] = partial;
+		}
 	}
 
 	uint8_t face_light(int face)
@@ -266,30 +373,59 @@ struct BlockRenderer
 		return q;
 	}
 
-	uint16_t face_light2(int face)
+	// Ambient occlusion of <face> at chunk vertex <v> (all 4 blocks sharing <v> on outer side of <face>, and their neighbours)
+	int compute_vertex_light(int face, glm::ivec3 v)
 	{
-		const int* f = Cube::faces[face];
-		int q = 0;
-		FOR(i, 4)
+		int c = Cube::faces[face][0];
+		glm::ivec3 p = v - Cube::corner[c];
+		glm::i8vec3* map = Cube::lightmap[face][c];
+		glm::i8vec3* map2 = Cube::lightmap2[face][c];
+		int s = 0;
+		FOR(j, 4)
 		{
-			glm::i8vec3* map = Cube::lightmap[face][f[i]];
-			glm::i8vec3* map2 = Cube::lightmap2[face][f[i]];
-			int s = 0;
-			FOR(j, 4)
+			Block b = get_local(p + glm::ivec3(map[j]));
+			if (can_see_through(b))
 			{
-				Block b = get(glm::ivec3(map[j]));
-				if (can_see_through(b))
+				s += (b == Block::none) ? 2 : 1;
+				FOR(k, 3)
 				{
-					s += (b == Block::none) ? 2 : 1;
-					FOR(k, 3)
-					{
-						Block b2 = get(glm::ivec3(map2[j*3+k]));
-						if (can_see_through(b2)) s += (b2 == Block::none) ? 2 : 1;
-					}
+					Block b2 = get_local(p + glm::ivec3(map2[j*3+k]));
+					if (can_see_through(b2)) s += (b2 == Block::none) ? 2 : 1;
 				}
 			}
-			s = s / 2;
-			q |= (s - 1) << (i * 4);
+		}
+		return std::max(s / 2 - 1, 0);
+	}
+
+	int vertex_light(int face, glm::ivec3 v)
+	{
+		if (!m_light) return compute_vertex_light(face, v);
+		int i = LightField::index(v);
+		if (!m_light->valid(face, i)) m_light->set(face, i, compute_vertex_light(face, v));
+		return m_light->get(face, i);
+	}
+
+	uint16_t face_light2(int face)
+	{
+		const int* f = Cube::faces[face];
+		int q = 0;
+		FOR(i, 4) q |= vertex_light(face, m_pos + Cube::corner[f[i]]) << (i * 4);
+		return q;
+	}
+
+	// Side face of partial water: light interpolated between bottom and top vertices
+	uint16_t face_light2(int face, int zmin, int zmax)
+	{
+		const int* f = Cube::faces[face];
+		int q = 0;
+		FOR(i, 4)
+		{
+			glm::ivec3 c = Cube::corner[f[i]];
+			glm::ivec3 v = m_pos + glm::ivec3(c.x, c.y, 0);
+			int a = vertex_light(face, v);
+			int b = vertex_light(face, v + iz);
+			int z = c.z ? zmax : zmin;
+			q |= (a + (b - a) * z / 15) << (i * 4);
 		}
 		return q;
 	}
@@ -367,107 +503,283 @@ struct BlockRenderer
 		}
 	}
 
-	void generate_quads(glm::ivec3 cpos, const Blocks* chunks[27], bool merge, std::vector<Quad>& out, int& blended_quads)
+	void generate_quads(glm::ivec3 cpos, const Blocks* chunks[27], LightField* light, bool merge, std::vector<Quad>& out, int& blended_quads)
 	{
-		out.clear();
+		m_light = light;
 		m_quadsp.clear();
-		m_quads = merge ? &m_quadsp : &out;
-		m_chunks = chunks;
-		m_cxpos = cpos << ChunkSizeBits;
-		const Blocks& mc = *chunks[13];
-		FOR(z, ChunkSize) FOR(y, ChunkSize) FOR(x, ChunkSize)
+		m_quads = &m_quadsp;
+		copy_neighbourhood(chunks);
+		FOR(z, ChunkSize) FOR(y, ChunkSize)
+		{
+			// Candidate faces: non-empty block next to see-through block (and tops of partial water)
+			// Exact rules are applied by draw_*() for candidates only.
+			int pz = z + Pad, py = y + Pad;
+			uint32_t self = m_solid[pz][py] >> Pad;
+			uint32_t faces[6];
+			faces[0] = self & (m_see[pz][py] >> (Pad - 1));
+			faces[1] = self & (m_see[pz][py] >> (Pad + 1));
+			faces[2] = self & (m_see[pz][py - 1] >> Pad);
+			faces[3] = self & (m_see[pz][py + 1] >> Pad);
+			faces[4] = self & (m_see[pz - 1][py] >> Pad);
+			faces[5] = self & ((m_see[pz + 1][py] | m_partial[pz][py]) >> Pad);
+			uint32_t any = (faces[0] | faces[1] | faces[2] | faces[3] | faces[4] | faces[5]) & ((1u << ChunkSize) - 1);
+
+			while (any)
+			{
+				int x = __builtin_ctz(any);
+				any &= any - 1;
+				uint32_t bit = 1u << x;
+				m_pos = glm::ivec3(x, y, z);
+				m_block = get(glm::ivec3(0, 0, 0));
+
+				if (is_water(m_block))
+				{
+					int w = uint(m_block) - uint(Block::water1) + 1;
+					FOR(f, 4) if (faces[f] & bit) draw_water_side(f, w);
+					if (faces[4] & bit) draw_water_bottom();
+					if (faces[5] & bit) draw_water_top(w);
+				}
+				else
+				{
+					if (faces[0] & bit) draw_non_water_face<true>(0);
+					if (faces[1] & bit) draw_non_water_face<true>(1);
+					if (faces[2] & bit) draw_non_water_face<true>(2);
+					if (faces[3] & bit) draw_non_water_face<true>(3);
+					if (faces[4] & bit) draw_non_water_face<false>(4);
+					if (faces[5] & bit) draw_non_water_face<false>(5);
+				}
+			}
+		}
+		m_merged.clear();
+		if (merge) merge_quads(m_merged);
+		pack_quads(merge ? m_merged : m_quadsp, out, blended_quads);
+	}
+
+	// Blended quads go to the end
+	static void pack_quads(const std::vector<MeshQuad>& quads, std::vector<Quad>& out, int& blended_quads)
+	{
+		out.clear();
+		for (const MeshQuad& q : quads) if (!is_blended(q.texture)) out.push_back(pack(q));
+		blended_quads = out.size();
+		for (const MeshQuad& q : quads) if (is_blended(q.texture)) out.push_back(pack(q));
+		blended_quads = out.size() - blended_quads;
+	}
+
+	// Mesh of chunk downsampled by 2^<lod>: each cell is its most common block, if at least half of it is non-empty.
+	// Border faces are culled against <neighbours> downsampled the same way, except on faces in <skirts> (bit per face:
+	// neighbour missing or rendered at finer LOD), where they are kept as skirts hiding cracks between levels.
+	void generate_lod_quads(const Blocks& blocks, const Blocks* neighbours[6], int skirts, int lod, std::vector<Quad>& out, int& blended_quads)
+	{
+		const int S = 1 << lod, N = ChunkSize >> lod;
+		auto downsample = [S](const Blocks& b, glm::ivec3 c)
 		{
-			glm::ivec3 p(x, y, z);
-			Block block = mc[p];
-			if (block == Block::none) continue;
-			m_pos = p;
-			m_block = block;
+			uint8_t count[256];
+			memset(count, 0, sizeof(count));
+			int filled = 0;
+			Block best = Block::none;
+			FOR(k, S * S * S)
+			{
+				Block e = b[c * S + glm::ivec3(k % S, (k / S) % S, k / (S * S))];
+				if (e == Block::none) continue;
+				filled += 1;
+				if (++count[uint(e)] > count[uint(best)]) best = e;
+			}
+			return (filled * 2 >= S * S * S) ? best : Block::none;
+		};
+
+		Block cells[ChunkSize3];
+		FOR(z, N) FOR(y, N) FOR(x, N) cells[(z * N + y) * N + x] = downsample(blocks, glm::ivec3(x, y, z));
 
-			if (is_water(block))
+		// Cell layer of each neighbour touching this chunk, indexed [face][v * N + u]
+		Block border[6][ChunkSize * ChunkSize];
+		FOR(face, 6)
+		{
+			if (skirts & (1 << face)) continue;
+			int axis = face / 2;
+			FOR(v, N) FOR(u, N)
 			{
-				int w = uint(block) - uint(Block::water1) + 1;
-				draw_water_side(0, w);
-				draw_water_side(1, w);
-				draw_water_side(2, w);
-				draw_water_side(3, w);
-				draw_water_bottom();
-				draw_water_top(w);
+				glm::ivec3 c;
+				c[axis] = (face & 1) ? 0 : N - 1;
+				c[(axis + 1) % 3] = u;
+				c[(axis + 2) % 3] = v;
+				border[face][v * N + u] = downsample(*neighbours[face], c);
 			}
-			else
+		}
+
+		auto cell = [&](glm::ivec3 p)
+		{
+			int face = -1;
+			FOR(axis, 3) if (p[axis] < 0 || p[axis] >= N)
+			{
+				if (face != -1) return Block::none; // chunk edges and corners only matter for ambient occlusion
+				face = axis * 2 + ((p[axis] >= N) ? 1 : 0);
+			}
+			if (face == -1) return cells[(p.z * N + p.y) * N + p.x];
+			if (skirts & (1 << face)) return Block::none;
+			int axis = face / 2;
+			return border[face][p[(axis + 2) % 3] * N + p[(axis + 1) % 3]];
+		};
+
+		m_quadsp.clear();
+		FOR(z, N) FOR(y, N) FOR(x, N)
+		{
+			glm::ivec3 p(x, y, z);
+			Block c = cell(p);
+			if (c == Block::none) continue;
+			FOR(face, 6)
 			{
-				draw_non_water_face<true>(0);
-				draw_non_water_face<true>(1);
-				draw_non_water_face<true>(2);
-				draw_non_water_face<true>(3);
-				draw_non_water_face<false>(4);
-				draw_non_water_face<false>(5);
+				Block n = cell(p + face_dir[face]);
+				if (n != Block::none && !(can_see_through(n) && n != c)) continue;
+
+				// Emitted in cell units (so merge_quads sees unit cells), scaled below
+				MeshQuad q;
+				q.texture = get_block_texture(c, face);
+				const int* f = Cube::faces[face];
+				q.light = 0;
+				FOR(i, 4)
+				{
+					// Simple ambient occlusion: see-through cells among 4 cells around vertex
+					glm::i8vec3* map = Cube::lightmap[face][f[i]];
+					int s = 0;
+					FOR(j, 4) if (can_see_through(cell(p + glm::ivec3(map[j])))) s += 1;
+					q.pos[i] = glm::u8vec3((p + Cube::corner[f[i]]) * 15);
+					q.light |= (s * 4 - 1) << (i * 4);
+				}
+				q.plane = (face << 8) | q.pos[0][face / 2];
+				m_quadsp.push_back(q);
 			}
 		}
-		if (merge) merge_quads(out);
-		if (!merge) std::partition(out.begin(), out.end(), [](const Quad& q) { return !is_blended(q.texture); });
-		blended_quads = 0;
-		while (blended_quads < out.size() && is_blended(out[out.size() - 1 - blended_quads].texture)) blended_quads += 1;
+		m_merged.clear();
+		merge_quads(m_merged);
+		for (MeshQuad& q : m_merged)
+		{
+			FOR(i, 4) q.pos[i] *= S;
+			q.plane = (q.plane & 0xFF00) | q.pos[0][(q.plane >> 8) / 2];
+		}
+		pack_quads(m_merged, out, blended_quads);
 	}
 
-	static bool combine(Quad& a, Quad b, int X, int Y)
+	static int min_corner(const MeshQuad& q, int X)
 	{
-		if (a.pos[0][X] == b.pos[0][X] && a.pos[2][X] == b.pos[2][X] && a.pos[2][Y] == b.pos[0][Y])
-		{
-			a.pos[2] = b.pos[2];
-			if (a.pos[1][Y] == b.pos[0][Y]) a.pos[1] = b.pos[1];
-			if (a.pos[3][Y] == b.pos[0][Y]) a.pos[3] = b.pos[3];
-			return true;
-		}
-		return false;
+		return std::min(std::min(q.pos[0][X], q.pos[1][X]), std::min(q.pos[2][X], q.pos[3][X]));
 	}
 
-	static void merge_axis(std::vector<Quad>& quads, int X, int Y)
+	static int max_corner(const MeshQuad& q, int X)
 	{
-		std::sort(quads.begin(), quads.end(), [X, Y](Quad a, Quad b) { return a.pos[0][X] < b.pos[0][X] || (a.pos[0][X] == b.pos[0][X] && a.pos[0][Y] < b.pos[0][Y]); });
-		int w = 0;
-		for (Quad q : quads)
+		return std::max(std::max(q.pos[0][X], q.pos[1][X]), std::max(q.pos[2][X], q.pos[3][X]));
+	}
+
+	// Greedy rectangles from mask (bit x of row y = cell (x, y)), rows first. Returns number of rectangles.
+	static int greedy_rects(uint16_t mask[ChunkSize], glm::u8vec4 rects[ChunkSize * ChunkSize], bool rows_only)
+	{
+		int n = 0;
+		FOR(y, ChunkSize)
 		{
-			if (w == 0 || !combine(quads[w-1], q, X, Y)) quads[w++] = q;
+			while (mask[y])
+			{
+				int x = __builtin_ctz(mask[y]);
+				uint run = mask[y] >> x;
+				int w = __builtin_ctz(~run);
+				uint16_t row = ((1u << w) - 1) << x;
+				int h = 1;
+				while (!rows_only && y + h < ChunkSize && (mask[y + h] & row) == row)
+				{
+					mask[y + h] &= ~row;
+					h += 1;
+				}
+				mask[y] &= ~row;
+				rects[n++] = glm::u8vec4(x, y, w, h);
+			}
 		}
-		quads.resize(w);
+		return n;
 	}
 
-	void merge_quads(std::vector<Quad>& out)
+	static uint64_t hash_key(uint64_t k)
 	{
-		std::sort(m_quadsp.begin(), m_quadsp.end());
-		auto a = m_quadsp.begin();
-		while (a != m_quadsp.end())
-		{
-			auto b = a + 1;
-			while (b != m_quadsp.end() && a->texture == b->texture && a->plane == b->plane && a->light == b->light) b += 1;
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdlu;
+		return k ^ (k >> 33);
+	}
 
-			if (is_leaves(a->texture))
+	// Greedy meshing with bitmasks, no sorting.
+	// Quads are grouped by (plane, texture, light, corner order, V range within cell) into a 16x16 cell mask of their plane.
+	// Full cell groups are covered with rectangles in both orders (keeping the one with fewer quads),
+	// partial cells (water sides) can only merge along X.
+	void merge_quads(std::vector<MeshQuad>& out)
+	{
+		uint table_size = 64;
+		while (table_size < m_quadsp.size() * 2) table_size *= 2;
+		m_group_table.assign(table_size, 0);
+		m_groups.clear();
+
+		for (const MeshQuad& q : m_quadsp)
+		{
+			int axis = q.plane >> 9;
+			int X = (axis == 0) ? 1 : 0;
+			int Y = (axis == 2) ? 1 : 2;
+			int x = min_corner(q, X), ymin = min_corner(q, Y), ymax = max_corner(q, Y);
+			int y = ymin / 15, lo = ymin % 15, hi = ymax - y * 15;
+			if (x % 15 != 0 || max_corner(q, X) != x + 15 || hi > 15)
 			{
-				while (a < b) out.push_back(*a++);
+				out.push_back(q);
 				continue;
 			}
 
-			m_xy.clear();
-			m_yx.clear();
-			while (a < b)
+			uint corners = 0;
+			FOR(i, 4) corners |= (uint(q.pos[i][X] > x) << i) | (uint(q.pos[i][Y] > ymin) << (i + 4));
+			uint64_t key = uint64_t(q.plane) | (uint64_t(q.texture) << 16) | (uint64_t(q.light) << 32) | (uint64_t(lo) << 48) | (uint64_t(hi) << 52) | (uint64_t(corners) << 56);
+
+			uint h = hash_key(key) & (table_size - 1);
+			while (m_group_table[h] && m_groups[m_group_table[h] - 1].key != key) h = (h + 1) & (table_size - 1);
+			if (!m_group_table[h])
 			{
-				m_xy.push_back(*a);
-				m_yx.push_back(*a);
-				a += 1;
+				m_groups.emplace_back();
+				MergeGroup& g = m_groups.back();
+				g.key = key;
+				g.first = q;
+				g.lo = lo;
+				g.hi = hi;
+				FOR(i, ChunkSize) g.mask[i] = 0;
+				m_group_table[h] = m_groups.size();
 			}
+			m_groups[m_group_table[h] - 1].mask[y] |= 1 << (x / 15);
+		}
 
-			int axis = m_xy[0].plane >> 9;
-			int x = (axis == 0) ? 1 : 0;
-			int y = (axis == 2) ? 1 : 2;
-
-			merge_axis(m_xy, x, y);
-			merge_axis(m_xy, y, x);
-			merge_axis(m_yx, y, x);
-			merge_axis(m_yx, x, y);
-
-			if (m_xy.size() > m_yx.size()) std::swap(m_xy, m_yx);
-			for (Quad& q : m_xy)
+		glm::u8vec4 rects_xy[ChunkSize * ChunkSize], rects_yx[ChunkSize * ChunkSize];
+		for (MergeGroup& g : m_groups)
+		{
+			bool full = g.lo == 0 && g.hi == 15;
+			uint16_t mask_yx[ChunkSize];
+			if (full)
+			{
+				FOR(i, ChunkSize) mask_yx[i] = 0;
+				FOR(y, ChunkSize) for (uint m = g.mask[y]; m; m &= m - 1) mask_yx[__builtin_ctz(m)] |= 1 << y;
+			}
+			int n = greedy_rects(g.mask, rects_xy, !full);
+			bool transposed = false;
+			if (full)
+			{
+				int n_yx = greedy_rects(mask_yx, rects_yx, false);
+				transposed = n_yx < n;
+				if (transposed) n = n_yx;
+			}
+			glm::u8vec4* rects = transposed ? rects_yx : rects_xy;
+
+			const MeshQuad& t = g.first;
+			int axis = t.plane >> 9;
+			int X = (axis == 0) ? 1 : 0;
+			int Y = (axis == 2) ? 1 : 2;
+			uint corners = g.key >> 56;
+			FOR(j, n)
 			{
+				glm::u8vec4 r = rects[j];
+				if (transposed) r = glm::u8vec4(r.y, r.x, r.w, r.z);
+				MeshQuad q = t;
+				FOR(i, 4)
+				{
+					q.pos[i][X] = ((corners & (1 << i)) ? r.x + r.z : r.x) * 15;
+					q.pos[i][Y] = ((corners & (16 << i)) ? r.y + r.w - 1 : r.y) * 15 + ((corners & (16 << i)) ? g.hi : g.lo);
+				}
 				out.push_back(q);
 			}
 		}
@@ -537,7 +849,6 @@ struct Player
 	glm::ivec3 cpos;
 	std::atomic<CompressedIVec3> atomic_cpos;
 	glm::mat4 orientation;
-	bool broadcasted;
 
 	bool digging_on;
 	Timestamp digging_start;
@@ -551,6 +862,7 @@ struct Player
 };
 
 bool g_collision = true;
+bool g_occlusion_culling = true; // if false, visibility is raytraced
 
 Player g_player;
 double scroll_y = 0, scroll_dy = 0;
@@ -562,7 +874,6 @@ void Player::turn(float dx, float dy)
 	if (pitch > M_PI / 2 * 0.999) pitch = M_PI / 2 * 0.999;
 	if (pitch < -M_PI / 2 * 0.999) pitch = -M_PI / 2 * 0.999;
 	orientation = glm::rotate(glm::rotate(glm::mat4(), -yaw, glm::vec3(0, 0, 1)), -pitch, glm::vec3(1, 0, 0));
-	broadcasted = false;
 }
 
 void Player::start_digging(glm::ivec3 cube)
@@ -676,7 +987,6 @@ bool Player::load()
 	cpos = glm::ivec3(glm::floor(position)) >> ChunkSizeBits;
 	atomic_cpos = compress_ivec3(cpos);
 	digging_on = false;
-	broadcasted = false;
 	return true;
 }
 
@@ -768,74 +1078,290 @@ void Mesh::bounding_box(glm::vec3& min, glm::vec3& max) const
 
 // ===============
 
+// Dirty and occupancy masks have one bit per 4x4x4 sub-block of chunk
+uint64_t sub_block_bit(glm::ivec3 p)
+{
+	glm::ivec3 s = p >> (ChunkSizeBits - 2);
+	return 1lu << ((s.z * 4 + s.y) * 4 + s.x);
+}
+
+// Coarser occupancy mask: one bit per 8x8x8 sub-block of chunk
+uint8_t sub_block8_bit(glm::ivec3 p)
+{
+	glm::ivec3 s = p >> (ChunkSizeBits - 1);
+	return 1 << ((s.z * 2 + s.y) * 2 + s.x);
+}
+
+// Sub-blocks close enough to neighbour chunk in direction (x, y, z) to affect its mesh (ambient occlusion reaches 2 blocks)
+uint64_t dirty_border_mask[3][3][3];
+
+Initialize
+{
+	FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
+	{
+		glm::ivec3 d(x, y, z);
+		uint64_t mask = 0;
+		FOR(i, ChunkSize3)
+		{
+			glm::ivec3 p(i % ChunkSize, (i / ChunkSize) % ChunkSize, i / ChunkSize2);
+			glm::ivec3 e = p + d * 2;
+			bool near = true;
+			FOR(a, 3) if (d[a] != 0 && 0 <= e[a] && e[a] < ChunkSize) near = false;
+			if (near) mask |= sub_block_bit(p);
+		}
+		dirty_border_mask[x + 1][y + 1][z + 1] = mask;
+	}
+}
+
+// Bit of chunk connectivity mask for pair of faces a < b (15 pairs)
+int face_pair(int a, int b)
+{
+	if (a > b) std::swap(a, b);
+	return a * (11 - a) / 2 + b - a - 1;
+}
+
+// All chunk meshes live here. Created in render_init().
+BufferArena* g_quad_arena = nullptr;
+
 struct Chunk
 {
-	Chunk() : m_cpos(x_bad_ivec3) { }
+	Chunk() : m_cpos(x_bad_ivec3), m_lod(0), m_skirts(0), m_light(nullptr), m_arena_offset(0), m_arena_capacity(0), m_sort_camera(x_bad_ivec3), m_sort_octant(-2) { }
+	~Chunk() { delete m_light; }
 
 	Block get(glm::ivec3 a) const { return m_blocks[a]; }
 	const Block* getp(glm::ivec3 a) const { return m_blocks.getp(a); }
 	const Blocks& blocks() const { return m_blocks; }
 	bool empty() const { return m_empty; }
 
+	uint16_t connectivity() const { return m_connectivity; }
+
+	// Which pairs of chunk faces are connected through see-through blocks (for occlusion culling)
+	void update_connectivity()
+	{
+		if (m_empty)
+		{
+			m_connectivity = (1 << 15) - 1;
+			return;
+		}
+		static uint8_t visited[ChunkSize3];
+		static std::vector<int> stack;
+		memset(visited, 0, sizeof(visited));
+		const Block* blocks = m_blocks.data();
+		m_connectivity = 0;
+		FOR(start, ChunkSize3)
+		{
+			if (visited[start] || !can_see_through(blocks[start])) continue;
+			int faces = 0;
+			visited[start] = 1;
+			stack.push_back(start);
+			while (stack.size() > 0)
+			{
+				int i = stack.back();
+				stack.pop_back();
+				glm::ivec3 p(i % ChunkSize, (i / ChunkSize) % ChunkSize, i / ChunkSize2);
+				FOR(f, 6)
+				{
+					glm::ivec3 q = p + face_dir[f];
+					if (!between(glm::ivec3(0), q, glm::ivec3(ChunkSize - 1)))
+					{
+						faces |= 1 << f;
+						continue;
+					}
+					int j = (q.z * ChunkSize + q.y) * ChunkSize + q.x;
+					if (visited[j] || !can_see_through(blocks[j])) continue;
+					visited[j] = 1;
+					stack.push_back(j);
+				}
+			}
+			FOR(a, 6) FOR2(b, a + 1, 5) if ((faces & (1 << a)) && (faces & (1 << b))) m_connectivity |= 1 << face_pair(a, b);
+		}
+	}
+
+	// Is any block in 4^3 (or 8^3) sub-block containing <p> not Block::none?
+	bool occupied4(glm::ivec3 p) const { return (m_occupancy4 & sub_block_bit(p)) != 0; }
+	bool occupied8(glm::ivec3 p) const { return (m_occupancy8 & sub_block8_bit(p)) != 0; }
+
 	void update_empty()
 	{
-		m_empty = true;
-		FOR(i, ChunkSize3) if (m_blocks.data()[i] != Block::none)
+		m_occupancy4 = 0;
+		m_occupancy8 = 0;
+		FOR(z, ChunkSize) FOR(y, ChunkSize) FOR(x, ChunkSize)
 		{
-			m_empty = false;
-			break;
+			glm::ivec3 p(x, y, z);
+			if (m_blocks[p] != Block::none)
+			{
+				m_occupancy4 |= sub_block_bit(p);
+				m_occupancy8 |= sub_block8_bit(p);
+			}
 		}
+		m_empty = m_occupancy4 == 0;
 	}
 
+	// Blended quads are re-sorted (and re-uploaded) back to front only when needed:
+	// near chunks exactly whenever camera moves, far chunks along diagonal of camera's octant when it changes.
 	void sort(glm::vec3 camera)
 	{
-		if (m_blended_quads > 0)
+		if (m_blended_quads == 0) return;
+		glm::vec3 rel = camera - glm::vec3(m_cpos * ChunkSize + ChunkSize / 2);
+		glm::vec3 arel = glm::abs(rel);
+		bool near = std::max(std::max(arel.x, arel.y), arel.z) < ChunkSize * 1.5f;
+		int octant = near ? -1 : ((rel.x > 0) ? 1 : 0) | ((rel.y > 0) ? 2 : 0) | ((rel.z > 0) ? 4 : 0);
+		if (octant == m_sort_octant && (!near || camera == m_sort_camera)) return;
+		m_sort_octant = octant;
+		m_sort_camera = camera;
+
+		auto begin = m_quads.end() - m_blended_quads;
+		if (near)
+		{
+			// Quad positions are in 1/15 of block
+			glm::vec3 e = (camera - glm::vec3(get_cpos() << ChunkSizeBits)) * 15.0f;
+			std::sort(begin, m_quads.end(), [e](const Quad& a, const Quad& b) { return glm::distance2(a.center(), e) > glm::distance2(b.center(), e); });
+		}
+		else
 		{
-			camera -= get_cpos() << ChunkSizeBits;
-			auto cmp = [camera](const Quad& a, const Quad& b) { return distance(a, camera) > distance(b, camera); };
-			std::sort(m_quads.end() - m_blended_quads, m_quads.end(), cmp);
+			glm::vec3 d((rel.x > 0) ? 1 : -1, (rel.y > 0) ? 1 : -1, (rel.z > 0) ? 1 : -1);
+			auto key = [d](const Quad& q) { return glm::dot(q.center(), d); };
+			std::sort(begin, m_quads.end(), [key](const Quad& a, const Quad& b) { return key(a) < key(b); });
 		}
+		g_quad_arena->upload(m_arena_offset + m_quads.size() - m_blended_quads, m_blended_quads, &*begin);
 	}
 
-	void remesh(BlockRenderer& renderer, const Blocks* chunks[27])
+	int lod() const { return m_lod; }
+	int skirts() const { return m_skirts; }
+
+	void remesh(BlockRenderer& renderer, const Blocks* chunks[27], int lod, int skirts)
 	{
-		renderer.generate_quads(get_cpos(), chunks, true/*!m_active*/, m_quads, m_blended_quads);
+		if (lod == 0)
+		{
+			if (!m_light && !m_empty) m_light = new LightField;
+			renderer.generate_quads(get_cpos(), chunks, m_light, true/*!m_active*/, m_quads, m_blended_quads);
+		}
+		else
+		{
+			const Blocks* neighbours[6];
+			FOR(face, 6)
+			{
+				glm::ivec3 d = face_dir[face];
+				neighbours[face] = chunks[d.x * 9 + d.y * 3 + d.z + 13];
+				if (!neighbours[face]) skirts |= 1 << face;
+			}
+			renderer.generate_lod_quads(m_blocks, neighbours, skirts, lod, m_quads, m_blended_quads);
+		}
+		m_lod = lod;
+		m_skirts = skirts;
 		m_remesh = false;
+		m_sort_octant = -2;
+
+		// Keep the old allocation if the new mesh fits, to avoid churn on small edits
+		if (m_quads.size() > m_arena_capacity || m_quads.size() < m_arena_capacity / 4)
+		{
+			release_mesh();
+			m_arena_capacity = (m_quads.size() + 15) & ~15;
+			if (m_arena_capacity > 0) m_arena_offset = g_quad_arena->alloc(m_arena_capacity);
+		}
+		g_quad_arena->upload(m_arena_offset, m_quads.size(), m_quads.data());
 	}
 
+	// Mesh must already be in g_quad_arena, which must be bound to GL_ARRAY_BUFFER
 	int render()
 	{
-		glBufferData(GL_ARRAY_BUFFER, sizeof(Quad) * m_quads.size(), &m_quads[0], GL_STREAM_DRAW);
-		glDrawArrays(GL_POINTS, 0, m_quads.size());
+		glDrawArrays(GL_POINTS, m_arena_offset, m_quads.size());
+		return m_quads.size();
+	}
+
+	// Vertex pulling variant: one triangle strip instance per quad, read from buffer texture over g_quad_arena
+	int render_pulled(GLint quad_base_loc)
+	{
+		glUniform1i(quad_base_loc, m_arena_offset);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, m_quads.size());
 		return m_quads.size();
 	}
 
+	void release_mesh()
+	{
+		g_quad_arena->release(m_arena_offset, m_arena_capacity);
+		m_arena_offset = 0;
+		m_arena_capacity = 0;
+	}
+
+	// Dirty mask (see sub_block_bit()) and bounding box of blocks that differ from <blocks>.
+	// Chunk that isn't loaded yet compares as all Block::none (same as missing neighbour in BlockRenderer).
+	uint64_t changed_blocks(glm::ivec3 cpos, const Block blocks[ChunkSize3], glm::ivec3& min, glm::ivec3& max) const
+	{
+		bool loaded = cpos == m_cpos;
+		uint64_t dirty = 0;
+		min = glm::ivec3(ChunkSize);
+		max = glm::ivec3(-1);
+		FOR(z, ChunkSize) FOR(y, ChunkSize) FOR(x, ChunkSize)
+		{
+			glm::ivec3 p(x, y, z);
+			if ((loaded ? m_blocks[p] : Block::none) != blocks[(z * ChunkSize + y) * ChunkSize + x])
+			{
+				dirty |= sub_block_bit(p);
+				min = glm::min(min, p);
+				max = glm::max(max, p);
+			}
+		}
+		return dirty;
+	}
+
+	// Vertices in [min, max] (world coordinates, inclusive)
+	void invalidate_light(glm::ivec3 min, glm::ivec3 max)
+	{
+		if (!m_light) return;
+		glm::ivec3 origin = m_cpos * ChunkSize;
+		min = glm::max(min - origin, glm::ivec3(0));
+		max = glm::min(max - origin, glm::ivec3(ChunkSize));
+		if (min.x <= max.x && min.y <= max.y && min.z <= max.z) m_light->invalidate(min, max);
+	}
+
 	void init(glm::ivec3 cpos, Block blocks[ChunkSize3])
 	{
+		// Same chunk keeps its mesh (and arena allocation) until remeshed
+		if (cpos != m_cpos)
+		{
+			delete m_light;
+			m_light = nullptr;
+			m_quads.clear();
+			if (m_arena_capacity > 0) release_mesh();
+		}
 		memcpy(m_blocks.data(), blocks, sizeof(Block) * ChunkSize3);
 		update_empty();
-		m_quads.clear();
+		update_connectivity();
 		m_cpos = cpos;
-		m_remesh = true;
 	}
 
 	glm::ivec3 get_cpos() { return m_cpos; }
+	uint quad_count() const { return m_quads.size(); }
+	uint arena_offset() const { return m_arena_offset; }
 
 	bool m_remesh;
 	friend class Chunks;
 private:
 	bool m_empty;
+	uint8_t m_occupancy8;
+	uint64_t m_occupancy4;
+	uint16_t m_connectivity;
 	Blocks m_blocks;
 	glm::ivec3 m_cpos;
+	int m_lod; // of m_quads
+	int m_skirts; // faces of m_quads with LOD skirts
+	LightField* m_light; // allocated on first remesh of non-empty chunk
 	std::vector<Quad> m_quads;
 	int m_blended_quads;
+
+	// Location of m_quads in g_quad_arena
+	uint m_arena_offset;
+	uint m_arena_capacity;
+	glm::vec3 m_sort_camera;
+	int m_sort_octant; // -1 if sorted exactly for m_sort_camera, -2 if not sorted
 };
 
 class Chunks
 {
 public:
 
-	Chunks(): m_map(new Chunk[MapSize * MapSize * MapSize]) { }
+	Chunks(): m_map(new Chunk[MapSize * MapSize * MapSize]) { m_empty_slots.clear_all(); }
 
 	Block get_block(glm::ivec3 pos)
 	{
@@ -863,6 +1389,22 @@ public:
 		return chunk.get_cpos() == (pos >> ChunkSizeBits) && ::can_move_through(chunk.get(pos & ChunkSizeMask));
 	}
 
+	// First selectable block along ray, skipping empty and unloaded chunks and empty 8^3 / 4^3 cells of chunks
+	bool raycast(glm::vec3 orig, glm::vec3 dir, float max_dist, RayHit& hit)
+	{
+		auto skip = [this](glm::ivec3 cube)
+		{
+			glm::ivec3 cpos = cube >> ChunkSizeBits;
+			if (empty_slot(cpos)) return ChunkSizeBits;
+			Chunk& chunk = get(cpos);
+			if (chunk.get_cpos() != cpos) return ChunkSizeBits;
+			glm::ivec3 p = cube & ChunkSizeMask;
+			if (chunk.occupied4(p)) return 0;
+			return chunk.occupied8(p) ? 2 : 3;
+		};
+		return raycast_voxels(orig, dir, max_dist, [this](glm::ivec3 cube) { return selectable_block(cube); }, skip, hit);
+	}
+
 	Chunk& get(glm::ivec3 cpos)
 	{
 		cpos &= MapSizeMask;
@@ -875,53 +1417,101 @@ public:
 		return (chunk.get_cpos() == cpos) ? &chunk : nullptr;
 	}
 
+	// Compact map of loaded empty chunks (so raycasts can skip them without touching Chunk memory).
+	// Bit is per map slot: it can also be set for chunk MapSize away from loaded one.
+	bool empty_slot(glm::ivec3 cpos) { return m_empty_slots[cpos & MapSizeMask]; }
+
+	// Must be called after chunk at <cpos> changes
+	void update_empty_slot(glm::ivec3 cpos)
+	{
+		if (get(cpos).empty())
+		{
+			m_empty_slots.set(cpos & MapSizeMask);
+		}
+		else
+		{
+			m_empty_slots.clear(cpos & MapSizeMask);
+		}
+	}
+
 private:
 	Chunk* m_map; // Huge array in memory!
+	BitCube<MapSize> m_empty_slots;
 };
 
 Chunks g_chunks;
 
 // ======================
 
-void server_main();
+void server_main(uint8_t player_modes);
+void physics_benchmark(int count);
 Socket g_client;
 SocketBuffer g_recv_buffer;
 SocketBuffer g_send_buffer;
 bool g_fsync_ack;
 
+// Edits are sent to server by client_frame() in one MessageEditBatch per frame
+std::vector<BlockEdit> g_pending_edits;
+std::vector<RegionEdit> g_pending_regions;
+
 void edit_block(glm::ivec3 pos, Block block)
 {
-	write_text_message(g_send_buffer, "block %d %d %d %d", pos.x, pos.y, pos.z, block);
+	BlockEdit edit;
+	edit.set_position(pos);
+	edit.block = block;
+	g_pending_edits.push_back(edit);
 }
 
-// <scale> is size (in blocks) of the largest extent of mesh.
-void rasterize_mesh(const Mesh& mesh, glm::ivec3 base, float scale, Block block)
+void edit_region(RegionOp op, glm::ivec3 a, glm::ivec3 b, Block block = Block::none, Block match = Block::none)
 {
-	glm::vec3 min, max;
-	mesh.bounding_box(/*out*/min, /*out*/max);
-	glm::vec3 mesh_size = max - min;
-	float extent = glm::max(mesh_size.x, mesh_size.y, mesh_size.z);
-	float mesh_block = extent / scale; // size of block in model space
+	RegionEdit edit;
+	edit.op = op;
+	edit.block = block;
+	edit.match = match;
+	edit.set_corners(a, b);
+	g_pending_regions.push_back(edit);
+}
 
-	glm::ivec3 bmax = base + glm::ivec3(glm::floor(mesh_size / mesh_block));
+void client_send_edits()
+{
+	uint e = 0, r = 0;
+	while (e < g_pending_edits.size() || r < g_pending_regions.size())
+	{
+		uint edit_count = std::min<uint>(MaxBlockEditsPerMessage, g_pending_edits.size() - e);
+		uint region_count = std::min<uint>(255, g_pending_regions.size() - r);
+		write_edit_batch_message(g_send_buffer, g_pending_edits.data() + e, edit_count, g_pending_regions.data() + r, region_count);
+		e += edit_count;
+		r += region_count;
+	}
+	g_pending_edits.clear();
+	g_pending_regions.clear();
+}
 
+// Mesh import triangles in world coordinates, uploaded to server in parts by client_frame()
+struct MeshUpload
+{
+	std::mutex mutex;
+	std::vector<glm::vec3> vertices; // 3 per triangle
+	uint sent; // vertices
+	Block block;
+};
+
+MeshUpload g_mesh_upload;
+
+// <scale> is size (in blocks) of the largest extent of mesh.
+void transform_mesh(const Mesh& mesh, glm::ivec3 base, float scale, std::vector<glm::vec3>& vertices)
+{
+	glm::vec3 min, max;
+	mesh.bounding_box(/*out*/min, /*out*/max);
+	glm::vec3 mesh_size = max - min;
+	float extent = glm::max(mesh_size.x, mesh_size.y, mesh_size.z);
+	float mesh_block = extent / scale; // size of block in model space
+
+	vertices.resize(mesh.faces.size() * 3);
 	FOR(i, mesh.faces.size())
 	{
 		const Mesh::Face& face = mesh.faces[i];
-		glm::vec3 va = mesh.vertices[face.verts[0]];
-		glm::vec3 vb = mesh.vertices[face.verts[1]];
-		glm::vec3 vc = mesh.vertices[face.verts[2]];
-
-		FOR(p, 3)
-		{
-			glm::vec3 v2 = glm::mix(va, vb, p * 0.5f);
-			FOR(q, 3)
-			{
-				glm::vec3 v3 = glm::mix(v2, vc, q * 0.5f);
-				glm::ivec3 pos = base + glm::ivec3(glm::floor((v3 - min) / mesh_block));
-				edit_block(pos, block);
-			}
-		}
+		FOR(j, 3) vertices[i * 3 + j] = glm::vec3(base) + (mesh.vertices[face.verts[j]] - min) / mesh_block;
 	}
 }
 
@@ -955,6 +1545,25 @@ struct Directions : public std::vector<Direction>
 			add(0, 0, m);
 		}
 		FOR(i, size()) std::swap(operator[](std::rand() % size()), operator[](i));
+
+		// Group rays into tiles (keeping random order inside tile)
+		std::stable_sort(begin(), end(), [](const Direction& a, const Direction& b) { return tile(a.dir) < tile(b.dir); });
+		tiles.resize(6 * TileGrid * TileGrid);
+		FOR(t, tiles.size())
+		{
+			tiles[t].begin = tiles[t].end = 0;
+			tiles[t].dir = glm::vec3(0, 0, 0);
+			tiles[t].stale = true;
+			tiles[t].origin = glm::vec3(x_bad_ivec3);
+		}
+		FOR(i, size())
+		{
+			int t = tile(operator[](i).dir);
+			if (tiles[t].begin == tiles[t].end) tiles[t].begin = i;
+			tiles[t].end = i + 1;
+			tiles[t].dir += operator[](i).dir;
+		}
+		for (Tile& t : tiles) t.dir = glm::normalize(t.dir);
 	}
 	void add(int x, int y, int z)
 	{
@@ -963,14 +1572,122 @@ struct Directions : public std::vector<Direction>
 		e.inv_dir = glm::abs(1.0f / e.dir);
 		push_back(e);
 	}
+
+	// Rays grouped by cube map cell of their direction. Hits of tile are cached until camera moves MoveThreshold away
+	// from where tile was traced, or a chunk its rays can reach arrives or changes.
+	// So when camera only rotates (or moves a little), just tiles which come into view need to be traced.
+	enum { TileGrid = 16 };
+	static constexpr float TileRadius = 0.09f; // angular radius of tile (> sqrt(2) / TileGrid)
+	static constexpr float MoveThreshold = 2.0f;
+
+	struct Tile
+	{
+		int begin, end; // rays
+		glm::vec3 dir; // center
+		glm::vec3 origin; // camera position when traced
+		bool stale;
+		std::vector<glm::ivec3> hits;
+	};
+	std::vector<Tile> tiles;
+
+	static int tile(glm::vec3 d)
+	{
+		glm::vec3 a = glm::abs(d);
+		int axis = (a.x >= a.y && a.x >= a.z) ? 0 : (a.y >= a.z ? 1 : 2);
+		int face = axis * 2 + (d[axis] > 0 ? 1 : 0);
+		float u = d[(axis + 1) % 3] / a[axis], v = d[(axis + 2) % 3] / a[axis];
+		int iu = std::min<int>((u + 1) * 0.5f * TileGrid, TileGrid - 1);
+		int iv = std::min<int>((v + 1) * 0.5f * TileGrid, TileGrid - 1);
+		return (face * TileGrid + iv) * TileGrid + iu;
+	}
 } directions;
 
-int ray_it = 0;
-int rays_remaining = 0;
+int rays_remaining = 0; // rays of tiles in view still to be (re)traced, set to directions.size() to request visibility update
+
+// Marks tiles whose rays (from anywhere within MoveThreshold of camera) can reach chunk <cpos> as stale
+void invalidate_tiles(glm::ivec3 cpos)
+{
+	glm::vec3 d = glm::vec3(cpos * ChunkSize + ChunkSize / 2) - g_player.position;
+	float dist = glm::length(d);
+	float radius = ChunkSize * BlockRadius + Directions::MoveThreshold;
+	if (dist <= radius)
+	{
+		for (Directions::Tile& t : directions.tiles) t.stale = true;
+		return;
+	}
+	float angle = std::min<float>(Directions::TileRadius + std::asin(radius / dist), M_PI);
+	float c = std::cos(angle);
+	d /= dist;
+	for (Directions::Tile& t : directions.tiles) if (glm::dot(t.dir, d) >= c) t.stale = true;
+}
 
 VisibleChunks visible_chunks;
 
-void raytrace(Chunk* chunk, glm::ivec3 pos, glm::ivec3 cpos, const Block* bp, glm::ivec3 id, glm::vec3 dd, glm::vec3 crossing)
+// Fork-join pool: run(fn) calls fn(thread) on every worker and on calling thread (as thread 0), and waits for all of them.
+class ForkJoinPool
+{
+public:
+	ForkJoinPool(int workers) : m_fn(nullptr), m_generation(0), m_pending(0), m_stop(false)
+	{
+		FOR(i, workers) m_threads.push_back(std::thread([this, i]() { work(i + 1); }));
+	}
+
+	~ForkJoinPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_start.notify_all();
+		for (std::thread& t : m_threads) t.join();
+	}
+
+	int size() const { return m_threads.size() + 1; }
+
+	void run(const std::function<void(int)>& fn)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_fn = &fn;
+			m_pending = m_threads.size();
+			m_generation += 1;
+		}
+		m_start.notify_all();
+		fn(0);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this]() { return m_pending == 0; });
+	}
+
+private:
+	void work(int thread)
+	{
+		uint generation = 0;
+		while (true)
+		{
+			const std::function<void(int)>* fn;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_start.wait(lock, [this, generation]() { return m_stop || m_generation != generation; });
+				if (m_stop) return;
+				generation = m_generation;
+				fn = m_fn;
+			}
+			(*fn)(thread);
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (--m_pending == 0) m_done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_start, m_done;
+	const std::function<void(int)>* m_fn;
+	uint m_generation;
+	int m_pending;
+	bool m_stop;
+};
+
+void raytrace(Chunk* chunk, glm::ivec3 pos, glm::ivec3 cpos, const Block* bp, glm::ivec3 id, glm::vec3 dd, glm::vec3 crossing, std::vector<glm::ivec3>& hits)
 {
 	const float MaxDist = RenderDistance * ChunkSize;
 
@@ -1019,50 +1736,96 @@ void raytrace(Chunk* chunk, glm::ivec3 pos, glm::ivec3 cpos, const Block* bp, gl
 		Block block = *bp;
 		if (block != Block::none)
 		{
-			visible_chunks.add(cpos);
+			if (hits.size() == 0 || hits.back() != cpos) hits.push_back(cpos);
 			if (!can_see_through(block)) return;
 		}
+		else if (!chunk->occupied4(pos & ChunkSizeMask))
+		{
+			if (ray_skip_cell(pos, crossing, id, dd, chunk->occupied8(pos & ChunkSizeMask) ? 2 : 3, MaxDist) == -1) return;
+			if (cpos != (pos >> ChunkSizeBits)) { cpos = pos >> ChunkSizeBits; goto next_chunk; }
+			bp = chunk->getp(pos & ChunkSizeMask);
+			goto resume;
+		}
 	}
 
 next_chunk:
-	chunk = &g_chunks.get(cpos);
-	if (chunk->get_cpos() != cpos) return;
-	if (!chunk->empty())
+	if (!g_chunks.empty_slot(cpos))
 	{
+		chunk = &g_chunks.get(cpos);
+		if (chunk->get_cpos() != cpos) return;
 		bp = chunk->getp(pos & ChunkSizeMask);
 		goto resume;
 	}
+	if (ray_skip_cell(pos, crossing, id, dd, ChunkSizeBits, MaxDist) == -1) return;
+	cpos = pos >> ChunkSizeBits;
+	goto next_chunk;
+}
 
-	while (true)
+// Cave culling: breadth first search from camera chunk through chunk faces, only entering neighbour
+// if the face it is entered from is connected to face it is left through, never going back against
+// direction already taken, and staying in render distance and frustum.
+void update_render_list_occlusion(Frustum& frustum)
+{
+	struct Node
 	{
-		if (crossing.x < crossing.y && crossing.x < crossing.z)
-		{
-			if (crossing.x > MaxDist) return;
-			pos.x += id.x;
-			crossing.x += dd.x;
-			if (cpos.x != (pos.x >> ChunkSizeBits)) { cpos.x = pos.x >> ChunkSizeBits; goto next_chunk; }
-		}
-		else if (crossing.y < crossing.z)
-		{
-			if (crossing.y > MaxDist) return;
-			pos.y += id.y;
-			crossing.y += dd.y;
-			if (cpos.y != (pos.y >> ChunkSizeBits)) { cpos.y = pos.y >> ChunkSizeBits; goto next_chunk; }
-		}
-		else
+		glm::ivec3 cpos;
+		int from; // face entered through (-1 for camera chunk)
+		int dirs; // face directions taken so far
+	};
+	static std::vector<Node> queue;
+	static BitCube<MapSize> queued;
+
+	glm::ivec3 camera = glm::ivec3(glm::floor(g_player.position)) >> ChunkSizeBits;
+	visible_chunks.begin_update();
+	queued.clear_all();
+	queue.clear();
+
+	Node start;
+	start.cpos = camera;
+	start.from = -1;
+	start.dirs = 0;
+	queue.push_back(start);
+	queued.set(camera & MapSizeMask);
+
+	for (size_t qi = 0; qi < queue.size(); qi++)
+	{
+		Node node = queue[qi];
+		Chunk* chunk = g_chunks.get_opt(node.cpos);
+		if (!chunk) continue;
+		if (!chunk->empty()) visible_chunks.add(node.cpos);
+		uint16_t connectivity = chunk->connectivity();
+
+		FOR(f, 6)
 		{
-			if (crossing.z > MaxDist) return;
-			pos.z += id.z;
-			crossing.z += dd.z;
-			if (cpos.z != (pos.z >> ChunkSizeBits)) { cpos.z = pos.z >> ChunkSizeBits; goto next_chunk; }
+			if (node.dirs & (1 << (f ^ 1))) continue;
+			if (node.from != -1 && (node.from == f || !(connectivity & (1 << face_pair(node.from, f))))) continue;
+			glm::ivec3 d = node.cpos + face_dir[f] - camera;
+			if (glm::dot(d, d) > RenderDistance * RenderDistance) continue;
+			glm::ivec3 cpos = node.cpos + face_dir[f];
+			if (frustum.is_sphere_outside(glm::vec3(cpos * ChunkSize + ChunkSize / 2), ChunkSize * BlockRadius)) continue;
+			if (queued[cpos & MapSizeMask]) continue;
+			queued.set(cpos & MapSizeMask);
+
+			Node next;
+			next.cpos = cpos;
+			next.from = f ^ 1;
+			next.dirs = node.dirs | (1 << f);
+			queue.push_back(next);
 		}
 	}
+	visible_chunks.end_update(g_player.position);
+	rays_remaining = 0;
 }
 
 // which chunks must be rendered from the center chunk?
 void update_render_list(Frustum& frustum)
 {
 	if (rays_remaining == 0) return;
+	if (g_occlusion_culling)
+	{
+		update_render_list_occlusion(frustum);
+		return;
+	}
 
 	glm::vec3 origin = g_player.position;
 	glm::ivec3 pos = glm::ivec3(glm::floor(origin));
@@ -1070,6 +1833,23 @@ void update_render_list(Frustum& frustum)
 	Chunk* chunk = &g_chunks.get(cpos);
 	assert(chunk->get_cpos() == cpos);
 
+	// Tiles in view: cached ones are reused, stale ones are traced (closest to view direction first)
+	static std::vector<Directions::Tile*> view, stale;
+	view.clear();
+	stale.clear();
+	for (Directions::Tile& t : directions.tiles)
+	{
+		if (t.begin == t.end || frustum.is_sphere_outside(origin + t.dir, Directions::TileRadius)) continue;
+		view.push_back(&t);
+		if (t.stale || glm::distance2(t.origin, origin) > sqr(Directions::MoveThreshold)) stale.push_back(&t);
+	}
+	float* ma = glm::value_ptr(g_player.orientation);
+	glm::vec3 forward(ma[4], ma[5], ma[6]);
+	std::sort(stale.begin(), stale.end(), [forward](Directions::Tile* a, Directions::Tile* b) { return glm::dot(a->dir, forward) > glm::dot(b->dir, forward); });
+
+	// Workers only read chunks, and chunks only change on this thread (in client_frame()), which waits for workers
+	static ForkJoinPool pool(std::max<int>(std::thread::hardware_concurrency(), 1) - 1);
+
 	int64_t budget = 40 / Timestamp::milisec_per_tick;
 	Timestamp ta;
 
@@ -1078,26 +1858,58 @@ void update_render_list(Frustum& frustum)
 	glm::vec3 crossingA = glm::ceil(origin) - origin;
 	glm::vec3 crossingB = origin - glm::floor(origin);
 
-	int q = 0;
-	while (rays_remaining > 0)
+	// Threads claim tiles until all are traced or time budget is used (claimed tiles are always completed)
+	std::atomic<int> claimed(0);
+	pool.run([&](int thread)
 	{
-		const Direction& e = directions[ray_it++];
-		if (ray_it == directions.size()) ray_it = 0;
-		rays_remaining -= 1;
-		if (frustum.contains_point(g_player.position + e.dir))
+		const int Batch = 1024;
+		glm::ivec3 ids[Batch];
+		glm::vec3 crossings[Batch];
+		while (true)
 		{
-			glm::ivec3 id;
-			glm::vec3 crossing;
-			FOR(i, 3)
+			int i = claimed.fetch_add(1);
+			if (i >= stale.size()) break;
+			Directions::Tile& tile = *stale[i];
+			std::vector<glm::ivec3>& out = tile.hits;
+			out.clear();
+
+			// All rays of tile are traced (even if outside of frustum), so tile can be reused after rotation
+			for (int start = tile.begin; start < tile.end; start += Batch)
 			{
-				id[i] = (e.dir[i] > 0) ? 1 : -1;
-				crossing[i] = (e.inv_dir[i] == INFINITY) ? INFINITY : ((e.dir[i] > 0 ? crossingA[i] : crossingB[i]) * e.inv_dir[i]);
+				// Set up packet of rays, then trace them one by one
+				int n = std::min(Batch, tile.end - start);
+				FOR(k, n)
+				{
+					const Direction& e = directions[start + k];
+					FOR(a, 3)
+					{
+						ids[k][a] = (e.dir[a] > 0) ? 1 : -1;
+						crossings[k][a] = (e.inv_dir[a] == INFINITY) ? INFINITY : ((e.dir[a] > 0 ? crossingA[a] : crossingB[a]) * e.inv_dir[a]);
+					}
+				}
+				FOR(k, n) raytrace(chunk, pos, cpos, bp, ids[k], directions[start + k].inv_dir, crossings[k], out);
 			}
-			raytrace(chunk, pos, cpos, bp, id, e.inv_dir, crossing);
+			std::sort(out.begin(), out.end(), [](glm::ivec3 a, glm::ivec3 b) { return std::lexicographical_compare(&a.x, &a.x + 3, &b.x, &b.x + 3); });
+			out.erase(std::unique(out.begin(), out.end()), out.end());
+			tile.origin = origin;
+			tile.stale = false;
+
+			if (ta.elapsed() > budget) break;
 		}
-		if ((q++ % 1024) == 0 && ta.elapsed() > budget) break;
+	});
+
+	// Stale tiles which were not traced yet still contribute their old hits, so visibility doesn't drop out during motion
+	rays_remaining = 0;
+	for (int i = std::min<int>(claimed.load(), stale.size()); i < stale.size(); i++) rays_remaining += stale[i]->end - stale[i]->begin;
+	visible_chunks.begin_update();
+	for (Directions::Tile* t : view) for (glm::ivec3 c : t->hits) visible_chunks.add(c);
+	// Cached tiles can be traced up to MoveThreshold away, which matters most for chunks next to camera, so those are always added
+	FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
+	{
+		Chunk* c = g_chunks.get_opt(cpos + glm::ivec3(x, y, z));
+		if (c && !c->empty()) visible_chunks.add(c->get_cpos());
 	}
-	visible_chunks.sort(g_player.position, rays_remaining == 0);
+	visible_chunks.end_update(g_player.position);
 }
 
 namespace stats
@@ -1105,6 +1917,8 @@ namespace stats
 	int quad_count = 0;
 	int chunk_count = 0;
 
+	float upload_kb = 0; // chunk mesh uploads per frame
+
 	float frame_time_ms = 0;
 	float render_time_ms = 0;
 	float model_time_ms = 0;
@@ -1131,6 +1945,8 @@ bool show_palette = false;
 
 void mark_remesh_chunk(Chunk& chunk, glm::ivec3 pos, glm::ivec3 q);
 
+void reset_player_prediction();
+
 void on_key(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
 	show_palette = false;
@@ -1185,6 +2001,7 @@ void on_key(GLFWwindow* window, int key, int scancode, int action, int mods)
 			g_player.creative_mode = !g_player.creative_mode;
 			g_player.velocity = glm::vec3(0, 0, 0);
 			g_player.digging_on = false;
+			reset_player_prediction();
 		}
 	}
 }
@@ -1236,433 +2053,106 @@ void model_init(GLFWwindow* window)
 	glfwSetScrollCallback(window, on_scroll);
 }
 
-int NeighborBit(int dx, int dy, int dz)
-{
-	return 1 << ((dx + 1) + (dy + 1) * 3 + (dz + 1) * 9);
-}
-
-bool IsVertexFree(uint neighbors, int dx, int dy, int dz)
+// TODO: simplify
+int cube_neighbors2(glm::ivec3 cube)
 {
-	assert(abs(dx) + abs(dy) + abs(dz) == 3);
-	uint mask = NeighborBit(dx, dy, dz);
-	mask |= NeighborBit(0, dy, dz) | NeighborBit(dx, 0, dz) | NeighborBit(dx, dy, 0);
-	mask |= NeighborBit(0, 0, dz) | NeighborBit(dx, 0, 0) | NeighborBit(0, dy, 0);
-	return (neighbors & mask) == 0;
+	int neighbors = 0;
+	FOR2(dx, -1, 1) FOR2(dy, -1, 1) if (dx != 0 && dy != 0)
+	{
+		glm::ivec3 pos(cube.x + dx, cube.y + dy, cube.z);
+		if (!g_chunks.can_move_through(pos)) neighbors |= NeighborBit(dx, dy, 0);
+	}
+	return neighbors;
 }
 
-bool IsEdgeFree(uint neighbors, int dx, int dy, int dz)
+bool client_is_solid(glm::ivec3 cube)
 {
-	assert(abs(dx) + abs(dy) + abs(dz) == 2);
-	uint mask = NeighborBit(dx, dy, dz);
-	mask |= NeighborBit(0, dy, dz) | NeighborBit(dx, 0, dz) | NeighborBit(dx, dy, 0);
-	return (neighbors & mask) == 0;
+	return !g_chunks.can_move_through(cube);
 }
 
-int Resolve(glm::vec3& delta, float k, float x, float y, float z)
+bool client_is_water(glm::ivec3 cube)
 {
-	glm::vec3 d(x, y, z);
-	float ds = sqr(d);
-	if (ds < 1e-6) return -1;
-	delta = d * (k / sqrtf(ds) - 1);
-	return 1;
+	return g_chunks.get_block(cube, Block::none) == Block::water;
 }
 
-// Move sphere so that it is not coliding with cube
-//
-// Neighbors is 3x3x3 matrix of 27 bits representing nearby cubes.
-// Used to turn off vertices and edges that are not exposed.
-int sphere_vs_cube(glm::vec3& center, float radius, glm::ivec3 cube, int neighbors)
-{
-	float e = 0.5;
-	float x = center.x - cube.x - e;
-	float y = center.y - cube.y - e;
-	float z = center.z - cube.z - e;
-	float k = e + radius;
-
-	if (x >= k || x <= -k || y >= k || y <= -k || z >= k || z <= -k) return 0;
-
-	float s2 = sqr(radius + sqrtf(2) / 2);
-	if (x*x + y*y >= s2 || x*x + z*z >= s2 || y*y + z*z >= s2) return 0;
-
-	if (x*x + y*y + z*z >= sqr(radius + sqrt(3) / 2)) return 0;
-
-	// if center outside cube
-	if (x > +e)
-	{
-		if (y > +e)
-		{
-			if (z > +e) return IsVertexFree(neighbors, 1, 1, +1) ? Resolve(center, radius, x - e, y - e, z - e) : -1;
-			if (z < -e) return IsVertexFree(neighbors, 1, 1, -1) ? Resolve(center, radius, x - e, y - e, z + e) : -1;
-			return IsEdgeFree(neighbors, 1, 1, 0) ? Resolve(center, radius, x - e, y - e, 0) : -1;
-		}
-		if (y < -e)
-		{
-			if (z > +e) return IsVertexFree(neighbors, 1, -1, +1) ? Resolve(center, radius, x - e, y + e, z - e) : -1;
-			if (z < -e) return IsVertexFree(neighbors, 1, -1, -1) ? Resolve(center, radius, x - e, y + e, z + e) : -1;
-			return IsEdgeFree(neighbors, 1, -1, 0) ? Resolve(center, radius, x - e, y + e, 0) : -1;
-		}
-
-		if (z > +e) return IsEdgeFree(neighbors, 1, 0, +1) ? Resolve(center, radius, x - e, 0, z - e) : -1;
-		if (z < -e) return IsEdgeFree(neighbors, 1, 0, -1) ? Resolve(center, radius, x - e, 0, z + e) : -1;
-		center.x += radius - x + e;
-		return 1;
-	}
-
-	if (x < -e)
-	{
-		if (y > +e)
-		{
-			if (z > +e) return IsVertexFree(neighbors, -1, 1, +1) ? Resolve(center, radius, x + e, y - e, z - e) : -1;
-			if (z < -e) return IsVertexFree(neighbors, -1, 1, -1) ? Resolve(center, radius, x + e, y - e, z + e) : -1;
-			return IsEdgeFree(neighbors, -1, 1, 0) ? Resolve(center, radius, x + e, y - e, 0) : -1;
-		}
-		if (y < -e)
-		{
-			if (z > +e) return IsVertexFree(neighbors, -1, -1, +1) ? Resolve(center, radius, x + e, y + e, z - e) : -1;
-			if (z < -e) return IsVertexFree(neighbors, -1, -1, -1) ? Resolve(center, radius, x + e, y + e, z + e) : -1;
-			return IsEdgeFree(neighbors, -1, -1, 0) ? Resolve(center, radius, x + e, y + e, 0) : -1;
-		}
-
-		if (z > +e) return IsEdgeFree(neighbors, -1, 0, +1) ? Resolve(center, radius, x + e, 0, z - e) : -1;
-		if (z < -e) return IsEdgeFree(neighbors, -1, 0, -1) ? Resolve(center, radius, x + e, 0, z + e) : -1;
-		center.x += -radius - x - e;
-		return 1;
-	}
-
-	if (y > +e)
-	{
-		if (z > +e) return IsEdgeFree(neighbors, 0, 1, +1) ? Resolve(center, radius, 0, y - e, z - e) : -1;
-		if (z < -e) return IsEdgeFree(neighbors, 0, 1, -1) ? Resolve(center, radius, 0, y - e, z + e) : -1;
-		center.y += radius - y + e;
-		return 1;
-	}
-	if (y < -e)
-	{
-		if (z > +e) return IsEdgeFree(neighbors, 0, -1, +1) ? Resolve(center, radius, 0, y + e, z - e) : -1;
-		if (z < -e) return IsEdgeFree(neighbors, 0, -1, -1) ? Resolve(center, radius, 0, y + e, z + e) : -1;
-		center.y += -radius - y - e;
-		return 1;
-	}
-
-	if (z > +e)
-	{
-		center.z +=  radius - z + e;
-		return 1;
-	}
-	if (z < -e)
-	{
-		center.z += -radius - z - e;
-		return 1;
-	}
-
-	// center inside cube
-	float ax = fabs(x), ay = fabs(y);
-	if (ax > ay)
-	{
-		if (ax > fabs(z)) { center.x += (x > 0 ? k : -k) - x; return 1; }
-	}
-	else
-	{
-		if (ay > fabs(z)) { center.y += (y > 0 ? k : -k) - y; return 1; }
-	}
-	center.z += (z > 0 ? k : -k) - z;
-	return 1;
-}
+bool on_the_ground = false;
 
-int cuboid_vs_cube(glm::vec3 center, glm::vec3 radius, glm::ivec3 cube, glm::vec3& delta)
+// Client side prediction: player is simulated locally from the same fixed step inputs that are sent to server.
+// Server acks its authoritative state together with seq of next input step, and later inputs are replayed on top.
+struct PendingInput
 {
-	float e = 0.5;
-	float x = center.x - cube.x - e;
-	float y = center.y - cube.y - e;
-	float z = center.z - cube.z - e;
-
-	glm::vec3 k = radius + e;
-
-	if (x >= k.x || x <= -k.x || y >= k.y || y <= -k.y || z >= k.z || z <= -k.z) return 0;
-
-	float dx = (x > 0 ? k.x : -k.x) - x;
-	float dy = (y > 0 ? k.y : -k.y) - y;
-	float dz = (z > 0 ? k.z : -k.z) - z;
+	uint32_t seq;
+	PlayerInput input;
+};
 
-	if (std::abs(dx) < std::abs(dy))
-	{
-		if (std::abs(dx) < std::abs(dz))
-		{
-			delta = glm::vec3(dx, 0, 0);
-		}
-		else
-		{
-			delta = glm::vec3(0, 0, dz);
-		}
-	}
-	else
-	{
-		if (std::abs(dy) < std::abs(dz))
-		{
-			delta = glm::vec3(0, dy, 0);
-		}
-		else
-		{
-			delta = glm::vec3(0, 0, dz);
-		}
-	}
-	return 1;
-}
+arraydeque<PendingInput> g_pending_inputs; // simulated, but not yet acked by server
+std::vector<InputRun> g_unsent_inputs;
+uint32_t g_input_seq = 0; // seq of next input step
+uint32_t g_unsent_seq = 0; // seq of first step in g_unsent_inputs
+uint8_t g_spawn_id = 0;
+bool g_spawn_pending = true;
+double g_physics_time = 0; // frame time not yet simulated
 
-// Move cylinder so that it is not coliding with cube.
-// Cylinder is always facing up.
-//
-// Neighbors is 3x3x3 (only 4 corners are used) matrix of bits representing nearby cubes.
-// Used to turn off edges that are not exposed.
-int cylinder_vs_cube(glm::vec3 center, float radius, float /*half*/height, glm::ivec3 cube, glm::vec3& delta, int neighbors)
+PlayerState player_state()
 {
-	float e = 0.5;
-	float x = center.x - cube.x - e;
-	float y = center.y - cube.y - e;
-	float z = center.z - cube.z - e;
-	float kr = e + radius;
-	float kh = e + height;
-
-	if (x >= kr || x <= -kr || y >= kr || y <= -kr || z >= kh || z <= -kh) return 0;
-
-	float s2 = sqr(radius + sqrtf(2) / 2);
-	if (x*x + y*y >= s2) return 0;
-
-	// Compute delta XY
-	float dxy = 0;
-	if (x > +e)
-	{
-		if (y > +e)
-		{
-			if (!IsEdgeFree(neighbors, 1, 1, 0) || !Resolve(delta, radius, x - e, y - e, 0)) return -1;
-			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
-		}
-		else if (y < -e)
-		{
-			if (!IsEdgeFree(neighbors, 1, -1, 0) || !Resolve(delta, radius, x - e, y + e, 0)) return -1;
-			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
-		}
-		else
-		{
-			delta = glm::vec3(kr - x, 0, 0);
-			dxy = delta.x;
-		}
-	}
-	else if (x < -e)
-	{
-		if (y > +e)
-		{
-			if (!IsEdgeFree(neighbors, -1, 1, 0) || !Resolve(delta, radius, x + e, y - e, 0)) return -1;
-			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
-		}
-		else if (y < -e)
-		{
-			if (!IsEdgeFree(neighbors, -1, -1, 0) || !Resolve(delta, radius, x + e, y + e, 0)) return -1;
-			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
-		}
-		else
-		{
-			delta = glm::vec3(-kr - x, 0, 0);
-			dxy = -delta.x;
-		}
-	}
-	else
-	{
-		if (y > +e)
-		{
-			delta = glm::vec3(0, kr - y, 0);
-			dxy = delta.y;
-		}
-		else if (y < -e)
-		{
-			delta = glm::vec3(0, -kr - y, 0);
-			dxy = -delta.y;
-		}
-		else
-		{
-			// move either by X or Y, depending which one is less
-			float dx = (x > 0 ? kr : -kr) - x;
-			float dy = (y > 0 ? kr : -kr) - y;
-			if (std::abs(dx) < std::abs(dy))
-			{
-				delta = glm::vec3(dx, 0, 0);
-				dxy = std::abs(dx);
-			}
-			else
-			{
-				delta = glm::vec3(0, dy, 0);
-				dxy = std::abs(dy);
-			}
-		}
-	}
-
-	// Compute delta Z
-	float dz = (z > 0 ? kh : -kh) - z;
-	if (std::abs(dz) < dxy) delta = glm::vec3(0, 0, dz);
-	return 1;
+	PlayerState s;
+	s.position = g_player.position;
+	s.velocity = g_player.velocity;
+	s.on_ground = on_the_ground;
+	return s;
 }
 
-int cube_neighbors(glm::ivec3 cube)
+void set_player_state(const PlayerState& s)
 {
-	int neighbors = 0;
-	FOR2(dx, -1, 1) FOR2(dy, -1, 1) FOR2(dz, -1, 1)
-	{
-		glm::ivec3 pos(cube.x + dx, cube.y + dy, cube.z + dz);
-		if (!g_chunks.can_move_through(pos)) neighbors |= NeighborBit(dx, dy, dz);
-	}
-	return neighbors;
+	g_player.position = s.position;
+	g_player.velocity = s.velocity;
+	on_the_ground = s.on_ground;
 }
 
-// TODO: simplify
-int cube_neighbors2(glm::ivec3 cube)
+// Must be called after player state is changed other than by simulate_player(). Server takes over the new state.
+void reset_player_prediction()
 {
-	int neighbors = 0;
-	FOR2(dx, -1, 1) FOR2(dy, -1, 1) if (dx != 0 && dy != 0)
-	{
-		glm::ivec3 pos(cube.x + dx, cube.y + dy, cube.z);
-		if (!g_chunks.can_move_through(pos)) neighbors |= NeighborBit(dx, dy, 0);
-	}
-	return neighbors;
+	g_pending_inputs.clear();
+	g_unsent_inputs.clear();
+	g_unsent_seq = g_input_seq;
+	g_spawn_id += 1;
+	g_spawn_pending = true;
 }
 
-glm::vec3 gravity(glm::vec3 pos)
+void simulate_player_step(PlayerInput input)
 {
-	return glm::vec3(0, 0, -30);
+	PlayerState s = player_state();
+	simulate_player(s, input, client_is_solid, client_is_water);
+	set_player_state(s);
 
-	/*glm::vec3 dir = glm::vec3(MoonCenter) - pos;
-	double dist2 = glm::dot(dir, dir);
-	double a = 10000000;
+	PendingInput pending;
+	pending.seq = g_input_seq++;
+	pending.input = input;
+	g_pending_inputs.push_back(pending);
 
-	if (dist2 > MoonRadius * MoonRadius)
+	if (g_unsent_inputs.size() > 0 && g_unsent_inputs.back().input == input && g_unsent_inputs.back().repeat < 255)
 	{
-		return dir * (float)(a / (sqrt(dist2) * dist2));
+		g_unsent_inputs.back().repeat += 1;
+		return;
 	}
-	else
-	{
-		return dir * (float)(a / (MoonRadius * MoonRadius * MoonRadius));
-	}*/
+	InputRun run;
+	run.input = input;
+	run.repeat = 1;
+	g_unsent_inputs.push_back(run);
 }
 
-const float player_acc = 35;
-const float player_jump_dv = 15;
-const float player_max_vel = 10;
-
-bool on_the_ground = false;
-
-void simulate(float dt, glm::vec3 dir, bool jump)
+void client_receive_player_ack(const MessagePlayerAck& ack)
 {
-	if (g_player.creative_mode)
-	{
-		g_player.position += dir * (dt * 20);
-	}
-	else
-	{
-		glm::ivec3 p = glm::ivec3(glm::floor(g_player.position));
-		bool underwater = g_chunks.get_block(p) == Block::water;
+	if (ack.spawn_id != g_spawn_id) return;
+	while (g_pending_inputs.size() > 0 && int32_t(g_pending_inputs[0].seq - ack.seq) < 0) g_pending_inputs.pop_front();
 
-		if ((on_the_ground || underwater) && !jump)
-		{
-			if (dir.x != 0 || dir.y != 0 || dir.z != 0)
-			{
-				float d = glm::dot(dir, g_player.velocity);
-				glm::vec3 a = dir * d;
-				glm::vec3 b = g_player.velocity - a;
-				float p = dt * player_acc;
-
-				// Brake on side-velocity
-				float b_len = glm::length(b);
-				if (b_len <= p)
-				{
-					g_player.velocity -= b;
-					p -= b_len;
-
-					if (glm::length(a) > player_max_vel)
-					{
-						// Brake on velocity along running direction
-						g_player.velocity -= glm::normalize(a) * p;
-					}
-					else
-					{
-						glm::vec3 v = g_player.velocity + dir * p;
-						float v2 = glm::length2(v);
-						if (v2 < glm::length2(g_player.velocity) || v2 < player_max_vel * player_max_vel) g_player.velocity = v;
-					}
-				}
-				else
-				{
-					g_player.velocity -= glm::normalize(b) * p;
-				}
-			}
-			else
-			{
-				float v = glm::length(g_player.velocity);
-				if (v <= dt * player_acc)
-				{
-					g_player.velocity = glm::vec3(0, 0, 0);
-				}
-				else
-				{
-					g_player.velocity -= glm::normalize(g_player.velocity) * (dt * player_acc);
-				}
-			}
-		}
-		if (!underwater) g_player.velocity += gravity(g_player.position) * dt;
-		g_player.position += g_player.velocity * dt;
-	}
-
-	on_the_ground = false;
-	if (!g_collision && g_player.creative_mode) return;
-
-	FOR(i, 2)
-	{
-		// Resolve all collisions simultaneously
-		glm::ivec3 p = glm::ivec3(glm::floor(g_player.position));
-		glm::vec3 sum(0, 0, 0);
-		int c = 0;
-		FOR2(x, p.x - 1, p.x + 1) FOR2(y, p.y - 1, p.y + 1) FOR2(z, p.z - 1, p.z + 1)
-		{
-			glm::ivec3 cube(x, y, z);
-			if (g_chunks.can_move_through(cube)) continue;
-			glm::vec3 delta;
-			const float radius = 0.48;
-			glm::vec3 q = g_player.position;
-			if (true)
-			{
-				// q.z -= radius; BUG: unstable?
-				if (1 == cylinder_vs_cube(q, radius, radius * 2, cube, /*out*/delta, cube_neighbors(cube)))
-				{
-					sum += delta;
-					c += 1;
-				}
-			}
-			else if (false)
-			{
-				if (1 == sphere_vs_cube(q, radius, cube, cube_neighbors(cube)))
-				{
-					sum += q - g_player.position;
-					c += 1;
-				}
-			}
-			else
-			{
-				// q.z -= radius; BUG: unstable?
-				if (1 == cuboid_vs_cube(q, glm::vec3(radius, radius, radius * 2), cube, /*out*/delta))
-				{
-					sum += delta;
-					c += 1;
-				}
-			}
-		}
-		if (c == 0)	break;
-		float sum2 = glm::length2(sum);
-		if (sum2 == 0) return;
-
-		glm::vec3 normal = sum * glm::inversesqrt(sum2);
-		float d = glm::dot(normal, g_player.velocity);
-		if (d < 0) g_player.velocity -= d * normal;
-		if (glm::dot(normal, glm::normalize(gravity(g_player.position))) < -0.9) on_the_ground = true;
-		g_player.position += sum / (float)c;
-	}
+	PlayerState s;
+	s.position = glm::vec3(ack.position[0], ack.position[1], ack.position[2]);
+	s.velocity = glm::vec3(ack.velocity[0], ack.velocity[1], ack.velocity[2]);
+	s.on_ground = ack.on_ground;
+	FOR(i, g_pending_inputs.size()) simulate_player(s, g_pending_inputs[i].input, client_is_solid, client_is_water);
+	if (s.position != g_player.position) rays_remaining = directions.size();
+	set_player_state(s);
 }
 
 void model_move_player(GLFWwindow* window, float dt)
@@ -1688,34 +2178,28 @@ void model_move_player(GLFWwindow* window, float dt)
 	if (glfwGetKey(window, 'Q')) dir[2] += 1;
 	if (glfwGetKey(window, 'E')) dir[2] -= 1;
 
-	bool jump = false;
-	if (!g_player.creative_mode && on_the_ground && glfwGetKey(window, GLFW_KEY_SPACE))
-	{
-		g_player.velocity += glm::normalize(-gravity(g_player.position)) * player_jump_dv;
-		jump = true;
-	}
-
 	glm::vec3 p = g_player.position;
 	if (dir.x != 0 || dir.y != 0 || dir.z != 0)
 	{
 		show_palette = false;
 		dir = glm::normalize(dir);
 	}
-	while (dt > 0)
-	{
-		if (dt <= 0.008)
-		{
-			simulate(dt, dir, jump);
-			break;
-		}
-		simulate(0.008, dir, jump);
-		dt -= 0.008;
-	}
-	if (p != g_player.position)
+
+	PlayerInput input;
+	input.set_direction(dir);
+	input.flags = 0;
+	if (glfwGetKey(window, GLFW_KEY_SPACE)) input.flags |= PlayerInput::Jump;
+	if (g_player.creative_mode) input.flags |= PlayerInput::Creative;
+	if (!g_collision) input.flags |= PlayerInput::NoCollision;
+
+	// Only whole steps are simulated (so that server can repeat them exactly), remainder carries over to next frame
+	g_physics_time = std::min(g_physics_time + dt, 0.25);
+	while (g_physics_time >= PhysicsDt)
 	{
-		rays_remaining = directions.size();
-		g_player.broadcasted = false;
+		g_physics_time -= PhysicsDt;
+		simulate_player_step(input);
 	}
+	if (p != g_player.position) rays_remaining = directions.size();
 }
 
 float intersect_line_plane(glm::vec3 orig, glm::vec3 dir, glm::vec4 plane)
@@ -1725,77 +2209,18 @@ float intersect_line_plane(glm::vec3 orig, glm::vec3 dir, glm::vec4 plane)
 	return (-plane.w - glm::dot(orig, plane.xyz())) / glm::dot(dir, plane.xyz());
 }
 
-// Find cube face that contains closest point of intersection with the ray.
-// No results if ray's origin is inside the cube
-int intersects_ray_cube(glm::vec3 orig, glm::vec3 dir, glm::ivec3 cube)
-{
-	assert(is_unit_length(dir));
-	orig -= glm::dvec3(cube);
-	glm::vec3 cube_center(0.5f, 0.5f, 0.5f);
-	float pos = glm::dot(cube_center - orig, dir);
-	if (pos + BlockRadius < 0) return -1;
-
-	// optional, check if cube is far from ray
-	float dist2 = glm::distance2(cube_center, orig + dir * pos);
-	if (dist2 >= 0.75) return -1;
-
-	if (orig.x < 0 && dir.x > 0)
-	{
-		float d = -orig.x / dir.x;
-		glm::vec3 k = orig + dir * d;
-		if (0 <= k.y && k.y <= 1 && 0 <= k.z && k.z <= 1) return 0;
-	}
-	if (orig.x > 1 && dir.x < 0)
-	{
-		float d = (1 - orig.x) / dir.x;
-		glm::vec3 k = orig + dir * d;
-		if (0 <= k.y && k.y <= 1 && 0 <= k.z && k.z <= 1) return 1;
-	}
-	if (orig.y < 0 && dir.y > 0)
-	{
-		float d = -orig.y / dir.y;
-		glm::vec3 k = orig + dir * d;
-		if (0 <= k.x && k.x <= 1 && 0 <= k.z && k.z <= 1) return 2;
-	}
-	if (orig.y > 1 && dir.y < 0)
-	{
-		float d = (1 - orig.y) / dir.y;
-		glm::vec3 k = orig + dir * d;
-		if (0 <= k.x && k.x <= 1 && 0 <= k.z && k.z <= 1) return 3;
-	}
-	if (orig.z < 0 && dir.z > 0)
-	{
-		float d = -orig.z / dir.z;
-		glm::vec3 k = orig + dir * d;
-		if (0 <= k.x && k.x <= 1 && 0 <= k.y && k.y <= 1) return 4;
-	}
-	if (orig.z > 1 && dir.z < 0)
-	{
-		float d = (1 - orig.z) / dir.z;
-		glm::vec3 k = orig + dir * d;
-		if (0 <= k.x && k.x <= 1 && 0 <= k.y && k.y <= 1) return 5;
-	}
-	return -1;
-}
-
-Sphere select_sphere(10);
+const float SelectDistance = 10;
 
 bool select_cube(glm::ivec3& sel_cube, int& sel_face)
 {
-	glm::ivec3 p = glm::ivec3(glm::floor(g_player.position));
 	float* ma = glm::value_ptr(g_player.orientation);
 	glm::vec3 dir(ma[4], ma[5], ma[6]);
 
-	for (glm::ivec3 d : select_sphere)
-	{
-		glm::ivec3 cube = p + d;
-		if (g_chunks.selectable_block(cube) && (sel_face = intersects_ray_cube(g_player.position, dir, cube)) != -1)
-		{
-			sel_cube = cube;
-			return true;
-		}
-	}
-	return false;
+	RayHit hit;
+	if (!g_chunks.raycast(g_player.position, dir, SelectDistance, hit)) return false;
+	sel_cube = hit.cube;
+	sel_face = hit.face;
+	return true;
 }
 
 void model_orientation(GLFWwindow* window)
@@ -1858,7 +2283,6 @@ void model_frame(GLFWwindow* window, double delta_ms)
 	selection = select_cube(/*out*/sel_cube, /*out*/sel_face);
 	Timestamp tc;
 	model_digging(window);
-	visible_chunks.cleanup();
 
 	stats::collide_time_ms = glm::mix<float>(stats::collide_time_ms, ta.elapsed_ms(tb), 0.15f);
 	stats::select_time_ms = glm::mix<float>(stats::select_time_ms, tb.elapsed_ms(tc), 0.15f);
@@ -1873,20 +2297,40 @@ int line_program;
 GLuint line_matrix_loc;
 GLuint line_position_loc;
 
-int block_program;
-GLuint block_matrix_loc;
-GLuint block_sampler_loc;
-GLuint block_pos_loc;
-GLuint block_tick_loc;
-GLuint block_foglimit2_loc;
-GLuint block_eye_loc;
-GLuint block_pos0_loc;
-GLuint block_pos1_loc;
-GLuint block_pos2_loc;
-GLuint block_pos3_loc;
-GLuint block_texture_loc;
-GLuint block_light_loc;
-GLuint block_plane_loc;
+struct BlockProgram
+{
+	int program;
+	GLuint matrix_loc;
+	GLuint sampler_loc;
+	GLuint pos_loc; // not in batched variant
+	GLuint tick_loc;
+	GLuint foglimit2_loc;
+	GLuint eye_loc;
+	GLuint word0_loc;
+	GLuint word1_loc;
+	GLuint draw_id_loc; // batched variant only
+	GLuint quads_loc; // pull variant only
+	GLuint quad_base_loc; // pull variant only
+
+	void load(bool batched, bool pull);
+};
+
+BlockProgram block_program;
+BlockProgram block_batched_program;
+BlockProgram block_pull_program;
+
+// Vertex pulling path for world blocks (no geometry shader)
+bool g_pull = false;
+GLuint pull_texture;
+GLint pull_max_texels = 0;
+
+// Multi-draw indirect path for world blocks
+bool g_batched_supported = false;
+bool g_batched = true;
+GLuint batched_indirect_buffer;
+GLuint batched_origin_buffer;
+GLuint batched_draw_id_buffer;
+uint batched_draw_id_capacity = 0;
 
 int mesh_program;
 GLuint mesh_matrix_loc;
@@ -1903,33 +2347,95 @@ GLuint mesh_texture_loc;
 GLuint block_buffer;
 GLuint line_buffer;
 GLuint mesh_buffer;
+GLuint mesh_instance_buffer;
 
 int g_tick;
 
+// Final block texture array (after post-processing, with all mip levels) is cached in a single binary file,
+// which is memory mapped and uploaded directly on later runs, skipping PNG decoding.
+const char* const TextureCacheFile = "bdc256.cache";
+
+struct TextureCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width, height, layers, levels;
+	uint64_t key; // hash of names, sizes and modification times of source PNGs
+};
+
+const uint32_t TextureCacheMagic = 0x43544442; // "BDTC"
+const uint32_t TextureCacheVersion = 1;
+
 struct BlockTextureLoader
 {
 	BlockTextureLoader();
 	void load(BlockTexture block_texture);
 	void load_textures();
 
+private:
+	static bool is_extra_frame(BlockTexture tex);
+	static uint64_t source_key();
+	uint mip_levels() const;
+	uint64_t level_size(uint level) const;
+	void generate_mipmaps();
+	bool load_cache(uint64_t key);
+	void save_cache(uint64_t key);
+	void upload(const uint8_t* data);
+
 private:
 	uint m_width, m_height, m_size;
-	std::vector<uint8_t> m_pixels;
+	std::vector<uint8_t> m_pixels; // all mip levels, each level is <block_texture_count> layers
 };
 
 BlockTextureLoader::BlockTextureLoader()
 {
-	uint8_t* image;
-	char filename[1024];
-	snprintf(filename, sizeof(filename), "bdc256/%s.png", block_texture_name[0]);
-	uint error = lodepng_decode32_file(&image, &m_width, &m_height, filename);
-	if (error)
+	m_width = m_height = m_size = 0;
+}
+
+// Animation frames that are loaded together with the first frame
+bool BlockTextureLoader::is_extra_frame(BlockTexture tex)
+{
+	if (tex > BlockTexture::lava_still && tex <= BlockTexture::lava_still_31) return true;
+	if (tex > BlockTexture::lava_flow && tex <= BlockTexture::lava_flow_31) return true;
+	if (tex > BlockTexture::water_still && tex <= BlockTexture::water_still_63) return true;
+	if (tex > BlockTexture::water_flow && tex <= BlockTexture::water_flow_31) return true;
+	if (tex > BlockTexture::furnace_front_on && tex <= BlockTexture::ff_15) return true;
+	if (tex > BlockTexture::sea_lantern && tex <= BlockTexture::sl_4) return true;
+	return false;
+}
+
+uint64_t BlockTextureLoader::source_key()
+{
+	// FNV-1a
+	uint64_t key = 14695981039346656037ull;
+	auto mix = [&key](const void* data, size_t size)
 	{
-		fprintf(stderr, "lodepgn_decode32_file(%s) error %u: %s\n", filename, error, lodepng_error_text(error));
-		exit(1);
+		FOR(i, size) key = (key ^ ((const uint8_t*)data)[i]) * 1099511628211ull;
+	};
+	FOR(i, block_texture_count)
+	{
+		if (is_extra_frame(BlockTexture(i))) continue;
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "bdc256/%s.png", block_texture_name[i]);
+		mix(filename, strlen(filename));
+		struct stat st;
+		if (stat(filename, &st) != 0) continue;
+		int64_t a[2] = { (int64_t)st.st_size, (int64_t)st.st_mtime };
+		mix(a, sizeof(a));
 	}
-	free(image);
-	m_size = m_width * m_height * 4;
+	return key;
+}
+
+uint BlockTextureLoader::mip_levels() const
+{
+	uint levels = 1;
+	while ((std::max(m_width, m_height) >> levels) > 0) levels += 1;
+	return levels;
+}
+
+uint64_t BlockTextureLoader::level_size(uint level) const
+{
+	return uint64_t(std::max(1u, m_width >> level)) * std::max(1u, m_height >> level) * 4 * block_texture_count;
 }
 
 void BlockTextureLoader::load(BlockTexture tex)
@@ -1937,12 +2443,7 @@ void BlockTextureLoader::load(BlockTexture tex)
 	unsigned char* image;
 	unsigned iwidth, iheight;
 	char filename[1024];
-	if (tex > BlockTexture::lava_still && tex <= BlockTexture::lava_still_31) return;
-	if (tex > BlockTexture::lava_flow && tex <= BlockTexture::lava_flow_31) return;
-	if (tex > BlockTexture::water_still && tex <= BlockTexture::water_still_63) return;
-	if (tex > BlockTexture::water_flow && tex <= BlockTexture::water_flow_31) return;
-	if (tex > BlockTexture::furnace_front_on && tex <= BlockTexture::ff_15) return;
-	if (tex > BlockTexture::sea_lantern && tex <= BlockTexture::sl_4) return;
+	if (is_extra_frame(tex)) return;
 	snprintf(filename, sizeof(filename), "bdc256/%s.png", block_texture_name[uint(tex)]);
 	unsigned error = lodepng_decode32_file(&image, &iwidth, &iheight, filename);
 	if (error)
@@ -1966,23 +2467,142 @@ void BlockTextureLoader::load(BlockTexture tex)
 	}
 	if (tex == BlockTexture::cloud)
 	{
-		FOR(j, m_width * m_height)
-		{
-			pixel[j].a = pixel[j].r;
-		}
+		FOR(j, m_width * m_height)
+		{
+			pixel[j].a = pixel[j].r;
+		}
+	}
+
+	uint frames = 1;
+	if (tex == BlockTexture::water_still) frames = 64;
+	if (tex == BlockTexture::water_flow) frames = 32;
+	if (tex == BlockTexture::lava_still || tex == BlockTexture::lava_flow) frames = 32;
+	if (tex == BlockTexture::furnace_front_on) frames = 16;
+	if (tex == BlockTexture::sea_lantern) frames = 5;
+	memcpy(m_pixels.data() + uint(tex) * m_size, image, m_size * frames);
+}
+
+// Box filtered mip chain, appended after level 0 in m_pixels
+void BlockTextureLoader::generate_mipmaps()
+{
+	uint levels = mip_levels();
+	uint64_t total = 0;
+	FOR(level, levels) total += level_size(level);
+	m_pixels.resize(total);
+
+	const uint8_t* src = m_pixels.data();
+	uint8_t* dst = m_pixels.data() + level_size(0);
+	FOR2(level, 1, levels - 1)
+	{
+		uint sw = std::max(1u, m_width >> (level - 1)), sh = std::max(1u, m_height >> (level - 1));
+		uint dw = std::max(1u, m_width >> level), dh = std::max(1u, m_height >> level);
+		FOR(layer, block_texture_count)
+		{
+			const glm::u8vec4* s = (const glm::u8vec4*)src + layer * sw * sh;
+			glm::u8vec4* d = (glm::u8vec4*)dst + layer * dw * dh;
+			FOR(y, dh) FOR(x, dw)
+			{
+				uint ax = std::min<uint>(x * 2, sw - 1), bx = std::min<uint>(x * 2 + 1, sw - 1);
+				uint ay = std::min<uint>(y * 2, sh - 1), by = std::min<uint>(y * 2 + 1, sh - 1);
+				glm::uvec4 sum = glm::uvec4(s[ay * sw + ax]) + glm::uvec4(s[ay * sw + bx]) + glm::uvec4(s[by * sw + ax]) + glm::uvec4(s[by * sw + bx]);
+				d[y * dw + x] = glm::u8vec4((sum + 2u) / 4u);
+			}
+		}
+		src = dst;
+		dst += level_size(level);
+	}
+}
+
+bool BlockTextureLoader::load_cache(uint64_t key)
+{
+	int fd = open(TextureCacheFile, O_RDONLY);
+	if (fd == -1) return false;
+	Auto(close(fd));
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TextureCacheHeader)) return false;
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) return false;
+	Auto(munmap(data, st.st_size));
+
+	const TextureCacheHeader& h = *(const TextureCacheHeader*)data;
+	if (h.magic != TextureCacheMagic || h.version != TextureCacheVersion || h.key != key || h.layers != block_texture_count) return false;
+	m_width = h.width;
+	m_height = h.height;
+	m_size = m_width * m_height * 4;
+	if (h.levels != mip_levels()) return false;
+	uint64_t total = sizeof(TextureCacheHeader);
+	FOR(level, h.levels) total += level_size(level);
+	if ((uint64_t)st.st_size != total) return false;
+
+	upload((const uint8_t*)data + sizeof(TextureCacheHeader));
+	return true;
+}
+
+void BlockTextureLoader::save_cache(uint64_t key)
+{
+	TextureCacheHeader h;
+	h.magic = TextureCacheMagic;
+	h.version = TextureCacheVersion;
+	h.width = m_width;
+	h.height = m_height;
+	h.layers = block_texture_count;
+	h.levels = mip_levels();
+	h.key = key;
+
+	// Write to temporary file first, so that an interrupted write never leaves a valid looking cache
+	std::string temp = std::string(TextureCacheFile) + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Unable to write %s\n", temp.c_str());
+		return;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, file) == 1 && fwrite(m_pixels.data(), m_pixels.size(), 1, file) == 1;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(temp.c_str(), TextureCacheFile) != 0)
+	{
+		fprintf(stderr, "Unable to write %s\n", TextureCacheFile);
+		unlink(temp.c_str());
+	}
+}
+
+void BlockTextureLoader::upload(const uint8_t* data)
+{
+	uint levels = mip_levels();
+	glGenTextures(1, &block_texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, block_texture);
+	// Mip levels are uploaded, but filtering stays GL_NEAREST to keep the pixel art look
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	FOR(level, levels)
+	{
+		uint w = std::max(1u, m_width >> level), h = std::max(1u, m_height >> level);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA, w, h, block_texture_count, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		data += level_size(level);
 	}
-
-	uint frames = 1;
-	if (tex == BlockTexture::water_still) frames = 64;
-	if (tex == BlockTexture::water_flow) frames = 32;
-	if (tex == BlockTexture::lava_still || tex == BlockTexture::lava_flow) frames = 32;
-	if (tex == BlockTexture::furnace_front_on) frames = 16;
-	if (tex == BlockTexture::sea_lantern) frames = 5;
-	memcpy(m_pixels.data() + uint(tex) * m_size, image, m_size * frames);
 }
 
 void BlockTextureLoader::load_textures()
 {
+	uint64_t key = source_key();
+	if (load_cache(key)) return;
+	fprintf(stderr, "Building %s\n", TextureCacheFile);
+
+	uint8_t* image;
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "bdc256/%s.png", block_texture_name[0]);
+	uint error = lodepng_decode32_file(&image, &m_width, &m_height, filename);
+	if (error)
+	{
+		fprintf(stderr, "lodepgn_decode32_file(%s) error %u: %s\n", filename, error, lodepng_error_text(error));
+		exit(1);
+	}
+	free(image);
+	m_size = m_width * m_height * 4;
 	m_pixels.resize(m_width * m_height * 4 * block_texture_count);
 
 	// Use 7 instead of 8 threads to avoid the same thread from having to load all animated textures
@@ -1999,13 +2619,9 @@ void BlockTextureLoader::load_textures()
 	}
 	FOR(i, 7) threads[i].join();
 
-	glGenTextures(1, &block_texture);
-	glBindTexture(GL_TEXTURE_2D_ARRAY, block_texture);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, m_width, m_height, block_texture_count, 0, GL_RGBA, GL_UNSIGNED_BYTE, m_pixels.data());
+	generate_mipmaps();
+	save_cache(key);
+	upload(m_pixels.data());
 }
 
 int get_uniform_location(int program, const char* name)
@@ -2022,6 +2638,31 @@ int get_attrib_location(int program, const char* name)
 	return location;
 }
 
+void BlockProgram::load(bool batched, bool pull)
+{
+	// Batched variant needs SSBOs, so it is compiled as GLSL 4.30 with BATCHED defined.
+	// Quad expansion shared by geometry shader and pulling vertex shader is prepended to all block shaders.
+	std::string header = pull ? "#version 150\n#define PULL\n" : (batched ? "#version 430 core\n#define BATCHED\n" : "#version 150\n");
+	header += read_file("shaders/block_quad.glsl");
+	program = load_program("block", !pull, header.c_str());
+	matrix_loc = get_uniform_location(program, "matrix");
+	sampler_loc = get_uniform_location(program, "sampler");
+	if (!batched) pos_loc = get_uniform_location(program, "cpos");
+	tick_loc = get_uniform_location(program, "tick");
+	foglimit2_loc = get_uniform_location(program, "foglimit2");
+	eye_loc = get_uniform_location(program, "eye");
+
+	if (pull)
+	{
+		quads_loc = get_uniform_location(program, "quads");
+		quad_base_loc = get_uniform_location(program, "quad_base");
+		return;
+	}
+	word0_loc = get_attrib_location(program, "word0");
+	word1_loc = get_attrib_location(program, "word1");
+	if (batched) draw_id_loc = get_attrib_location(program, "draw_id");
+}
+
 struct MeshVertex
 {
 	glm::vec3 vertex_pos;
@@ -2053,21 +2694,24 @@ void render_init()
 	line_matrix_loc = get_uniform_location(line_program, "matrix");
 	line_position_loc = get_attrib_location(line_program, "position");
 
-	block_program = load_program("block", true);
-	block_matrix_loc = get_uniform_location(block_program, "matrix");
-	block_sampler_loc = get_uniform_location(block_program, "sampler");
-	block_pos_loc = get_uniform_location(block_program, "cpos");
-	block_tick_loc = get_uniform_location(block_program, "tick");
-	block_foglimit2_loc = get_uniform_location(block_program, "foglimit2");
-	block_eye_loc = get_uniform_location(block_program, "eye");
-
-	block_pos0_loc = get_attrib_location(block_program, "vertex0");
-	block_pos1_loc = get_attrib_location(block_program, "vertex1");
-	block_pos2_loc = get_attrib_location(block_program, "vertex2");
-	block_pos3_loc = get_attrib_location(block_program, "vertex3");
-	block_texture_loc = get_attrib_location(block_program, "block_texture_with_flag");
-	block_light_loc = get_attrib_location(block_program, "light");
-	block_plane_loc = get_attrib_location(block_program, "plane");
+	block_program.load(false, false);
+	block_pull_program.load(false, true);
+	glGenTextures(1, &pull_texture);
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &pull_max_texels);
+#ifdef GL_VERSION_4_3
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	g_batched_supported = major > 4 || (major == 4 && minor >= 3);
+#endif
+	if (g_batched_supported)
+	{
+		block_batched_program.load(true, false);
+		glGenBuffers(1, &batched_indirect_buffer);
+		glGenBuffers(1, &batched_origin_buffer);
+		glGenBuffers(1, &batched_draw_id_buffer);
+	}
+	fprintf(stderr, "Multi-draw indirect: %s\n", g_batched_supported ? "supported" : "not supported");
 
 	mesh_program = load_program("mesh");
 	mesh_matrix_loc = get_uniform_location(mesh_program, "matrix");
@@ -2075,16 +2719,17 @@ void render_init()
 	mesh_tick_loc = get_uniform_location(mesh_program, "tick");
 	mesh_foglimit2_loc = get_uniform_location(mesh_program, "foglimit2");
 	mesh_eye_loc = get_uniform_location(mesh_program, "eye");
-	mesh_mesh_pos_loc = get_uniform_location(mesh_program, "mesh_pos");
-	mesh_mesh_rot_loc = get_uniform_location(mesh_program, "mesh_rot");
-
+	mesh_mesh_pos_loc = get_attrib_location(mesh_program, "mesh_pos");
+	mesh_mesh_rot_loc = get_attrib_location(mesh_program, "mesh_rot");
 	mesh_vertex_pos_loc = get_attrib_location(mesh_program, "vertex_pos");
 	mesh_vertex_uv_loc = get_attrib_location(mesh_program, "vertex_uv");
 	mesh_texture_loc = get_attrib_location(mesh_program, "texture_with_flag");
 
 	glGenBuffers(1, &line_buffer);
 	glGenBuffers(1, &block_buffer);
+	g_quad_arena = new BufferArena(GL_ARRAY_BUFFER, sizeof(Quad), 1 << 20);
 	glGenBuffers(1, &mesh_buffer);
+	glGenBuffers(1, &mesh_instance_buffer);
 
 	GLuint vao;
 	glGenVertexArrays(1, &vao);
@@ -2129,18 +2774,22 @@ void render_init()
 		*e++ = { v2, glm::vec2(0, 0), texture };
 		*e++ = { v3, glm::vec2(0, v), texture };
 	}
+	glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * g_avatar_mesh.size(), &g_avatar_mesh[0], GL_STATIC_DRAW);
 }
 
 void BlockRenderer::draw_quad(int face, bool reverse, bool underwater_overlay)
 {
-	Quad q;
+	MeshQuad q;
 	q.texture = get_block_texture(m_block, face);
 	if (underwater_overlay) q.texture = BlockTexture((int)q.texture | (1 << 15));
 	const int* f = Cube::faces[face];
-	q.light = face_light2(face); // TODO reverse?
+	q.light = face_light2(face);
 	glm::ivec3 w = m_pos & ChunkSizeMask;
 	if (reverse)
 	{
+		// Light nibbles follow corners
+		q.light = (q.light & 0x0F0F) | ((q.light & 0x00F0) << 8) | ((q.light & 0xF000) >> 8);
 		q.pos[0] = glm::u8vec3((w + Cube::corner[f[0]]) * 15);
 		q.pos[1] = glm::u8vec3((w + Cube::corner[f[3]]) * 15);
 		q.pos[2] = glm::u8vec3((w + Cube::corner[f[2]]) * 15);
@@ -2165,14 +2814,16 @@ static glm::ivec3 adjust(glm::ivec3 v, int zmin, int zmax)
 
 void BlockRenderer::draw_quad(int face, int zmin, int zmax, bool reverse, bool underwater_overlay)
 {
-	Quad q;
+	MeshQuad q;
 	q.texture = get_block_texture(m_block, face);
 	if (underwater_overlay) q.texture = BlockTexture((int)q.texture | (1 << 15));
 	const int* f = Cube::faces[face];
-	q.light = face_light2(face); // TODO zmin/zmax? // TODO reverse?
+	q.light = (face < 4) ? face_light2(face, zmin, zmax) : face_light2(face);
 	glm::ivec3 w = m_pos & ChunkSizeMask;
 	if (reverse)
 	{
+		// Light nibbles follow corners
+		q.light = (q.light & 0x0F0F) | ((q.light & 0x00F0) << 8) | ((q.light & 0xF000) >> 8);
 		q.pos[0] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[0]], zmin, zmax));
 		q.pos[1] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[3]], zmin, zmax));
 		q.pos[2] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[2]], zmin, zmax));
@@ -2192,37 +2843,114 @@ void BlockRenderer::draw_quad(int face, int zmin, int zmax, bool reverse, bool u
 
 const float foglimit2 = sqr(0.8 * RenderDistance * ChunkSize);
 
+bool g_lod = true;
+
+// Distances where chunks switch to 2x and 4x downsampled meshes.
+// Switching back needs to get LodHysteresis closer, so chunks on the boundary don't remesh every frame.
+const float LodDistance[2] = { 12 * ChunkSize, 24 * ChunkSize };
+const float LodHysteresis = ChunkSize;
+
+int select_lod(float distance, int current)
+{
+	if (!g_lod) return 0;
+	int lod = 0;
+	FOR(i, 2) if (distance > LodDistance[i] + (current > i ? -LodHysteresis : LodHysteresis)) lod = i + 1;
+	return lod;
+}
+
+// Faces of chunk at <lod> which need skirts: neighbour is missing or rendered at finer LOD
+int select_skirts(glm::ivec3 cpos, int lod)
+{
+	if (lod == 0) return 0;
+	int skirts = 0;
+	FOR(face, 6)
+	{
+		glm::ivec3 n = cpos + face_dir[face];
+		Chunk* c = g_chunks.get_opt(n);
+		if (!c || select_lod(glm::distance(glm::vec3(n * ChunkSize + ChunkSize / 2), g_player.position), c->lod()) < lod) skirts |= 1 << face;
+	}
+	return skirts;
+}
+
+#ifdef GL_VERSION_4_3
+struct DrawArraysIndirectCommand
+{
+	GLuint count;
+	GLuint instance_count;
+	GLuint first;
+	GLuint base_instance;
+};
+
+// One glMultiDrawArraysIndirect for all chunks. Chunk origins are read by block.geom from SSBO,
+// indexed by per-instance <draw_id> attribute (fetched at base_instance).
+void render_chunks_batched(const BlockProgram& program, const std::vector<Chunk*>& render_list)
+{
+	static std::vector<DrawArraysIndirectCommand> commands;
+	static std::vector<glm::ivec4> origins;
+	commands.clear();
+	origins.clear();
+	for (Chunk* chunk : render_list)
+	{
+		if (chunk->quad_count() == 0) continue;
+		DrawArraysIndirectCommand c;
+		c.count = chunk->quad_count();
+		c.instance_count = 1;
+		c.first = chunk->arena_offset();
+		c.base_instance = commands.size();
+		commands.push_back(c);
+		origins.push_back(glm::ivec4(chunk->get_cpos() * ChunkSize, 0));
+		stats::quad_count += c.count;
+	}
+	stats::chunk_count += render_list.size();
+	if (commands.size() == 0) return;
+
+	if (batched_draw_id_capacity < commands.size())
+	{
+		batched_draw_id_capacity = std::max<uint>(commands.size(), batched_draw_id_capacity * 2);
+		std::vector<GLuint> ids(batched_draw_id_capacity);
+		FOR(i, ids.size()) ids[i] = i;
+		glBindBuffer(GL_ARRAY_BUFFER, batched_draw_id_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * ids.size(), ids.data(), GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, batched_draw_id_buffer);
+	glEnableVertexAttribArray(program.draw_id_loc);
+	glVertexAttribIPointer(program.draw_id_loc, 1, GL_UNSIGNED_INT, sizeof(GLuint), nullptr);
+	glVertexAttribDivisor(program.draw_id_loc, 1);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, batched_origin_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::ivec4) * origins.size(), origins.data(), GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, batched_origin_buffer);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batched_indirect_buffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawArraysIndirectCommand) * commands.size(), commands.data(), GL_STREAM_DRAW);
+	glMultiDrawArraysIndirect(GL_POINTS, nullptr, commands.size(), 0);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glVertexAttribDivisor(program.draw_id_loc, 0);
+	glDisableVertexAttribArray(program.draw_id_loc);
+}
+#endif
+
 void render_world_blocks(const glm::mat4& matrix, const Frustum& frustum)
 {
-	glUseProgram(block_program);
-	glUniformMatrix4fv(block_matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
-	glUniform3fv(block_eye_loc, 1, glm::value_ptr(g_player.position));
+	// Arena can outgrow the buffer texture limit, in which case fall back to the geometry shader
+	bool pull = g_pull && g_quad_arena->capacity() <= (uint)pull_max_texels;
+	bool batched = g_batched && g_batched_supported && !pull;
+	const BlockProgram& program = pull ? block_pull_program : batched ? block_batched_program : block_program;
+	glUseProgram(program.program);
+	glUniformMatrix4fv(program.matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
+	glUniform3fv(program.eye_loc, 1, glm::value_ptr(g_player.position));
 	if (!g_player.creative_mode) g_tick += 1;
-	glUniform1i(block_tick_loc, g_tick);
-	glUniform1f(block_foglimit2_loc, foglimit2);
-
-	glBindBuffer(GL_ARRAY_BUFFER, block_buffer);
-	glEnableVertexAttribArray(block_pos0_loc);
-	glEnableVertexAttribArray(block_pos1_loc);
-	glEnableVertexAttribArray(block_pos2_loc);
-	glEnableVertexAttribArray(block_pos3_loc);
-	glEnableVertexAttribArray(block_texture_loc);
-	glEnableVertexAttribArray(block_light_loc);
-	glEnableVertexAttribArray(block_plane_loc);
-
-	glVertexAttribIPointer(block_pos0_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[0]);
-	glVertexAttribIPointer(block_pos1_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[1]);
-	glVertexAttribIPointer(block_pos2_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[2]);
-	glVertexAttribIPointer(block_pos3_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[3]);
-	glVertexAttribIPointer(block_texture_loc, 1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->texture);
-	glVertexAttribIPointer(block_light_loc,   1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->light);
-	glVertexAttribIPointer(block_plane_loc,   1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->plane);
+	glUniform1i(program.tick_loc, g_tick);
+	glUniform1f(program.foglimit2_loc, foglimit2);
 
 	stats::chunk_count = 0;
 	stats::quad_count = 0;
 
-	glEnable(GL_BLEND);
+	// Remesh and sort first, as uploads may grow (and replace) the arena buffer
 	static BlockRenderer renderer;
+	static std::vector<Chunk*> render_list;
+	render_list.clear();
 	for (VisibleChunks::Element e : visible_chunks)
 	{
 		glm::ivec3 cpos = e.cpos;
@@ -2231,7 +2959,9 @@ void render_world_blocks(const glm::mat4& matrix, const Frustum& frustum)
 			Chunk& chunk = g_chunks.get(cpos);
 			if (chunk.get_cpos() != cpos) continue;
 
-			if (chunk.m_remesh)
+			int lod = select_lod(glm::distance(glm::vec3(cpos * ChunkSize + ChunkSize / 2), g_player.position), chunk.lod());
+			int skirts = select_skirts(cpos, lod);
+			if (chunk.m_remesh || lod != chunk.lod() || skirts != chunk.skirts())
 			{
 				const Blocks* chunks[27];
 				FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
@@ -2239,27 +2969,127 @@ void render_world_blocks(const glm::mat4& matrix, const Frustum& frustum)
 					Chunk* c = g_chunks.get_opt(cpos + glm::ivec3(x, y, z));
 					chunks[x*9 + y*3 + z + 13] = c ? &c->blocks() : nullptr;
 				}
-				chunk.remesh(renderer, chunks);
+				chunk.remesh(renderer, chunks, lod, skirts);
 			}
-			glm::ivec3 pos = cpos * ChunkSize;
-			glUniform3iv(block_pos_loc, 1, glm::value_ptr(pos));
-			// TODO: avoid expensive sorting for far chunks
 			chunk.sort(g_player.position);
-			stats::quad_count += chunk.render();
+			render_list.push_back(&chunk);
+		}
+	}
+	stats::upload_kb = glm::mix<float>(stats::upload_kb, g_quad_arena->take_upload_bytes() / 1024.0f, 0.15f);
+
+	if (pull)
+	{
+		// Rebound every frame, as arena buffer is replaced when it grows
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_BUFFER, pull_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, g_quad_arena->buffer());
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(program.quads_loc, 1);
+
+		glEnable(GL_BLEND);
+		for (Chunk* chunk : render_list)
+		{
+			glm::ivec3 pos = chunk->get_cpos() * ChunkSize;
+			glUniform3iv(program.pos_loc, 1, glm::value_ptr(pos));
+			stats::quad_count += chunk->render_pulled(program.quad_base_loc);
 			stats::chunk_count += 1;
 		}
+		glDisable(GL_BLEND);
+		return;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, g_quad_arena->buffer());
+	glEnableVertexAttribArray(program.word0_loc);
+	glEnableVertexAttribArray(program.word1_loc);
+	glVertexAttribIPointer(program.word0_loc, 1, GL_UNSIGNED_INT, sizeof(Quad), &((Quad*)0)->word0);
+	glVertexAttribIPointer(program.word1_loc, 1, GL_UNSIGNED_INT, sizeof(Quad), &((Quad*)0)->word1);
+
+	glEnable(GL_BLEND);
+#ifdef GL_VERSION_4_3
+	if (batched)
+	{
+		render_chunks_batched(program, render_list);
+		glDisable(GL_BLEND);
+		return;
+	}
+#endif
+	for (Chunk* chunk : render_list)
+	{
+		glm::ivec3 pos = chunk->get_cpos() * ChunkSize;
+		glUniform3iv(program.pos_loc, 1, glm::value_ptr(pos));
+		stats::quad_count += chunk->render();
+		stats::chunk_count += 1;
 	}
 	glDisable(GL_BLEND);
 }
 
+// Remote avatars are rendered this far in the past, interpolating between received states
+const double InterpolationDelay = 0.1;
+const int AvatarSnapshots = 16;
+
+struct AvatarSnapshot
+{
+	double time; // when received
+	glm::vec3 position;
+	float yaw, pitch;
+};
+
 struct Avatar
 {
 	bool visible;
 	glm::vec3 position;
 	float yaw, pitch;
 	glm::mat3 rotation;
+
+	// Interpolation buffer, oldest first
+	AvatarSnapshot snapshots[AvatarSnapshots];
+	uint snapshot_count;
+
+	void receive(const AvatarSnapshot& a);
+	void interpolate(double time);
 };
 
+void Avatar::receive(const AvatarSnapshot& a)
+{
+	if (snapshot_count > 0 && a.time - snapshots[snapshot_count - 1].time > InterpolationDelay)
+	{
+		// Server sends nothing while avatar stands still: hold last state until just before this one, instead of sliding across the gap
+		AvatarSnapshot hold = snapshots[snapshot_count - 1];
+		hold.time = a.time - PhysicsDt;
+		receive(hold);
+	}
+	if (snapshot_count == AvatarSnapshots)
+	{
+		std::copy(snapshots + 1, snapshots + AvatarSnapshots, snapshots);
+		snapshot_count -= 1;
+	}
+	snapshots[snapshot_count++] = a;
+}
+
+void Avatar::interpolate(double time)
+{
+	if (snapshot_count == 0) return;
+
+	// Drop snapshots older than the one just before <time>
+	uint i = 0;
+	while (i + 1 < snapshot_count && snapshots[i + 1].time <= time) i += 1;
+	if (i > 0)
+	{
+		std::copy(snapshots + i, snapshots + snapshot_count, snapshots);
+		snapshot_count -= i;
+	}
+
+	const AvatarSnapshot& a = snapshots[0];
+	const AvatarSnapshot& b = snapshots[(snapshot_count > 1 && time > a.time) ? 1 : 0];
+	float t = (b.time > a.time) ? glm::clamp<float>((time - a.time) / (b.time - a.time), 0, 1) : 0;
+	position = glm::mix(a.position, b.position, t);
+	float dyaw = b.yaw - a.yaw;
+	dyaw -= float(2 * M_PI) * std::round(dyaw / float(2 * M_PI));
+	yaw = a.yaw + dyaw * t;
+	pitch = glm::mix(a.pitch, b.pitch, t);
+	rotation = rotate_z(M_PI / 2) * rotate_x(pitch) * rotate_z(yaw);
+}
+
 struct Avatars
 {
 	Avatar& add(int index)
@@ -2267,6 +3097,7 @@ struct Avatars
 		if (!avatars[index].visible)
 		{
 			avatars[index].visible = true;
+			avatars[index].snapshot_count = 0;
 			list.push_back(index);
 		}
 		return avatars[index];
@@ -2294,12 +3125,36 @@ struct Avatars
 
 Avatars g_avatars;
 
+// Per-instance attributes of avatar mesh
+struct MeshInstance
+{
+	glm::vec3 position;
+	glm::mat3 rotation;
+};
+
+std::vector<MeshInstance> g_avatar_instances;
+
+// All visible avatars are drawn with one instanced draw: mesh is static in mesh_buffer, instances are streamed every frame.
 void render_avatars(const glm::mat4& matrix, const Frustum& frustum)
 {
+	float radius = sqrt(5) * PlayerRadius;
+	double time = glfwGetTime() - InterpolationDelay;
+	g_avatar_instances.clear();
+	for (uint8_t index : g_avatars.list)
+	{
+		Avatar& avatar = g_avatars.avatars[index];
+		avatar.interpolate(time);
+		if (!frustum.is_sphere_outside(avatar.position, radius))
+		{
+			g_avatar_instances.push_back({ avatar.position, avatar.rotation });
+		}
+	}
+	if (!g_player.creative_mode) g_tick += 1;
+	if (g_avatar_instances.size() == 0) return;
+
 	glUseProgram(mesh_program);
 	glUniformMatrix4fv(mesh_matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
 	glUniform3fv(mesh_eye_loc, 1, glm::value_ptr(g_player.position));
-	if (!g_player.creative_mode) g_tick += 1;
 	glUniform1i(mesh_tick_loc, g_tick);
 	glUniform1f(mesh_foglimit2_loc, foglimit2);
 	glUniform1i(mesh_sampler_loc, 0);
@@ -2314,20 +3169,36 @@ void render_avatars(const glm::mat4& matrix, const Frustum& frustum)
 	glVertexAttribPointer(mesh_vertex_uv_loc,  2, GL_FLOAT, GL_FALSE, sizeof(*m), &m->vertex_uv);
 	glVertexAttribIPointer(mesh_texture_loc,   1, GL_UNSIGNED_SHORT, sizeof(*m), &m->texture);
 
-	float radius = sqrt(5) * 0.48; // TODO constant - player cylinder radius
-	glEnable(GL_BLEND);
-	for (uint8_t index : g_avatars.list)
+	// Orphan and refill instance buffer, so driver doesn't wait for previous frame's draw
+	glBindBuffer(GL_ARRAY_BUFFER, mesh_instance_buffer);
+	uint size = sizeof(MeshInstance) * g_avatar_instances.size();
+	glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, g_avatar_instances.data());
+
+	// mat3 attribute takes three consecutive locations, one per column
+	MeshInstance* n = nullptr;
+	glEnableVertexAttribArray(mesh_mesh_pos_loc);
+	glVertexAttribPointer(mesh_mesh_pos_loc, 3, GL_FLOAT, GL_FALSE, sizeof(*n), &n->position);
+	glVertexAttribDivisor(mesh_mesh_pos_loc, 1);
+	FOR(i, 3)
 	{
-		Avatar& avatar = g_avatars.avatars[index];
-		if (!frustum.is_sphere_outside(avatar.position, radius))
-		{
-			glUniform3fv(mesh_mesh_pos_loc, 1, glm::value_ptr(avatar.position));
-			glUniformMatrix3fv(mesh_mesh_rot_loc, 1, GL_FALSE, glm::value_ptr(avatar.rotation));
-			glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * g_avatar_mesh.size(), &g_avatar_mesh[0], GL_STREAM_DRAW);
-			glDrawArrays(GL_TRIANGLES, 0, g_avatar_mesh.size());
-		}
+		glEnableVertexAttribArray(mesh_mesh_rot_loc + i);
+		glVertexAttribPointer(mesh_mesh_rot_loc + i, 3, GL_FLOAT, GL_FALSE, sizeof(*n), &n->rotation[i]);
+		glVertexAttribDivisor(mesh_mesh_rot_loc + i, 1);
 	}
+
+	glEnable(GL_BLEND);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, g_avatar_mesh.size(), g_avatar_instances.size());
 	glDisable(GL_BLEND);
+
+	// Attribute state is shared with other programs
+	glVertexAttribDivisor(mesh_mesh_pos_loc, 0);
+	glDisableVertexAttribArray(mesh_mesh_pos_loc);
+	FOR(i, 3)
+	{
+		glVertexAttribDivisor(mesh_mesh_rot_loc + i, 0);
+		glDisableVertexAttribArray(mesh_mesh_rot_loc + i);
+	}
 }
 
 struct ChatLine
@@ -2391,15 +3262,23 @@ bool client_receive_message()
 		client_receive_text_message(message->text, message->size);
 		return true;
 	}
-	case MessageType::AvatarState:
+	case MessageType::AvatarUpdates:
 	{
-		auto message = recv.read<MessageAvatarState>();
+		auto message = read_avatar_updates_message(recv);
 		if (!message) return false;
-		Avatar& avatar = g_avatars.add(message->id);
-		avatar.position = message->position;
-		avatar.yaw = message->yaw;
-		avatar.pitch = message->pitch;
-		avatar.rotation = rotate_z(M_PI / 2) * rotate_x(message->pitch) * rotate_z(message->yaw);
+		// Removals first: id of avatar which left can be reused by a new one updated in the same message
+		const uint8_t* removed = (const uint8_t*)(message->updates + message->update_count);
+		FOR(i, message->remove_count) g_avatars.remove(removed[i]);
+		glm::vec3 origin = glm::vec3(message->cpos[0], message->cpos[1], message->cpos[2]) * float(ChunkSize);
+		AvatarSnapshot snapshot;
+		snapshot.time = glfwGetTime();
+		FOR(i, message->update_count)
+		{
+			const AvatarUpdate& update = message->updates[i];
+			snapshot.position = origin + glm::vec3(update.position[0], update.position[1], update.position[2]) / float(AvatarPositionScale);
+			unpack_orientation(update.orientation, snapshot.yaw, snapshot.pitch);
+			g_avatars.add(update.id).receive(snapshot);
+		}
 		return true;
 	}
 	case MessageType::ChunkState:
@@ -2407,14 +3286,46 @@ bool client_receive_message()
 		auto message = recv.read<MessageChunkState>();
 		if (!message) return false;
 		Chunk& chunk = g_chunks.get(message->cpos);
+		// Neighbours are remeshed only if changed blocks are close to them.
+		// Light of vertices up to 2 blocks away from changed blocks needs recomputing.
+		glm::ivec3 min, max;
+		uint64_t dirty = chunk.changed_blocks(message->cpos, message->blocks, min, max);
+		bool loaded = chunk.get_cpos() == message->cpos;
+		if (!loaded)
+		{
+			// New chunk can open (or close) paths, even if it is empty (rays stop at unloaded chunks)
+			chunk.m_remesh = true;
+			invalidate_tiles(message->cpos);
+			rays_remaining = directions.size();
+		}
 		chunk.init(message->cpos, message->blocks);
+		g_chunks.update_empty_slot(message->cpos);
+		if (dirty == 0) return true;
+		invalidate_tiles(message->cpos);
+		rays_remaining = directions.size();
+		glm::ivec3 origin = message->cpos * ChunkSize;
 		FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
 		{
+			if (!(dirty & dirty_border_mask[x + 1][y + 1][z + 1])) continue;
 			Chunk* c = g_chunks.get_opt(message->cpos + glm::ivec3(x, y, z));
-			if (c) c->m_remesh = true; // TODO optimize this
+			if (!c) continue;
+			c->m_remesh = true;
+			c->invalidate_light(origin + min - 1, origin + max + 2);
 		}
 		return true;
 	}
+	case MessageType::PlayerAck:
+	{
+		auto message = recv.read<MessagePlayerAck>();
+		if (!message) return false;
+		client_receive_player_ack(*message);
+		return true;
+	}
+	case MessageType::PlayerInput: FAIL;
+	case MessageType::PlayerSpawn: FAIL;
+	case MessageType::MeshTriangles: FAIL;
+	case MessageType::MeshImport: FAIL;
+	case MessageType::EditBatch: FAIL;
 	case MessageType::ServerStatus:
 	{
 		auto message = recv.read<MessageServerStatus>();
@@ -2427,6 +3338,28 @@ bool client_receive_message()
 	return false;
 }
 
+// Sends pending mesh import in parts, keeping send buffer small, then asks server to voxelize it
+void client_upload_mesh()
+{
+	MeshUpload& upload = g_mesh_upload;
+	AutoLock(upload.mutex);
+	if (upload.vertices.size() == 0) return;
+	while (upload.sent < upload.vertices.size() && g_send_buffer.size() < (1 << 18))
+	{
+		uint count = std::min<uint>(MeshTrianglesPerMessage, (upload.vertices.size() - upload.sent) / 3);
+		write_mesh_triangles_message(g_send_buffer, &upload.vertices[upload.sent], count);
+		upload.sent += count * 3;
+	}
+	if (upload.sent < upload.vertices.size()) return;
+
+	MessageMeshImport message;
+	message.type = MessageType::MeshImport;
+	message.block = upload.block;
+	g_send_buffer.write(message);
+	console.Print("uploaded %u triangles\n", (uint)upload.vertices.size() / 3);
+	release(upload.vertices);
+}
+
 void client_frame()
 {
 	uint size_before = g_recv_buffer.size();
@@ -2434,15 +3367,26 @@ void client_frame()
 	g_bytes_received = g_recv_buffer.size() - size_before;
 	while (client_receive_message()) { }
 
-	if (!g_player.broadcasted)
+	if (g_spawn_pending)
+	{
+		g_spawn_pending = false;
+		MessagePlayerSpawn message;
+		message.type = MessageType::PlayerSpawn;
+		message.spawn_id = g_spawn_id;
+		message.seq = g_unsent_seq;
+		FOR(i, 3) message.position[i] = g_player.position[i];
+		FOR(i, 3) message.velocity[i] = g_player.velocity[i];
+		g_send_buffer.write(message);
+	}
+	for (uint i = 0; i < g_unsent_inputs.size(); i += 255)
 	{
-		g_player.broadcasted = true;
-		auto message = g_send_buffer.write<MessageAvatarState>();
-		message->type = MessageType::AvatarState;
-		message->position = g_player.position;
-		message->pitch = g_player.pitch;
-		message->yaw = g_player.yaw;
+		uint count = std::min<uint>(255, g_unsent_inputs.size() - i);
+		write_player_input_message(g_send_buffer, g_unsent_seq, g_player.yaw, g_player.pitch, &g_unsent_inputs[i], count);
+		FOR(j, count) g_unsent_seq += g_unsent_inputs[i + j].repeat;
 	}
+	g_unsent_inputs.clear();
+	client_send_edits();
+	client_upload_mesh();
 	CHECK2(g_send_buffer.send_any(g_client), exit(1));
 }
 
@@ -2459,8 +3403,9 @@ void render_gui()
 			stats::frame_time_ms, stats::model_time_ms, stats::raytrace_time_ms, raytrace, stats::render_time_ms,
 			enable_f4 ? '4' : '-', enable_f5 ? '5' : '-', enable_f6 ? '6' : '-', g_recv_buffer.size(), g_send_buffer.size());
 
-		text->Print("collide:%1.0f select:%1.0f simulate:%1.0f [%.1f %.1f %.1f] %.1f%s",
+		text->Print("collide:%1.0f select:%1.0f simulate:%1.0f upload:%.0fkb arena:%uk/%uk [%.1f %.1f %.1f] %.1f%s",
 			stats::collide_time_ms, stats::select_time_ms, stats::simulate_time_ms,
+			stats::upload_kb, g_quad_arena->used() / 1000, g_quad_arena->capacity() / 1000,
 			g_player.velocity.x, g_player.velocity.y, g_player.velocity.z, glm::length(g_player.velocity), on_the_ground ? " ground" : "");
 
 		text->Print("exchange:%u inbox:%u simulation:%u chunk:%u avatar:%u received:%ukb frame:%u",
@@ -2501,70 +3446,59 @@ void render_gui()
 
 	text->Reset(width, height, matrix, true);
 	console.Render(text, glfwGetTime());
-	glUseProgram(0);
+	// HUD, chat and console in one draw, under palette and crosshair
+	text->Flush();
 
 	if (show_palette)
 	{
 		if (scroll_dy <= 0.1 / 5) scroll_y += (std::round(scroll_y) - scroll_y) * 0.05;
 
 		glBindTexture(GL_TEXTURE_2D_ARRAY, block_texture);
-		glUseProgram(block_program);
+		glUseProgram(block_program.program);
 		glm::mat4 view;
 		view = glm::rotate(view, float(M_PI * 1.75), glm::vec3(1,0,0));
 		view = glm::rotate(view, float(M_PI * 0.25), glm::vec3(0,0,1));
 		view = glm::translate(view, glm::vec3(-128,-128,-128));
 		view = glm::ortho<float>(-8 * width / height, 8 * width / height, -8, 8, -64, 64) * view;
 		view = glm::translate(view, glm::vec3(-scroll_y, scroll_y, -1));
-		glUniformMatrix4fv(block_matrix_loc, 1, GL_FALSE, glm::value_ptr(view));
+		glUniformMatrix4fv(block_program.matrix_loc, 1, GL_FALSE, glm::value_ptr(view));
 
 		glm::vec3 eye(8, 8, 8);
-		glUniform3fv(block_eye_loc, 1, glm::value_ptr(eye));
-		glUniform1i(block_tick_loc, g_tick);
-		glUniform1f(block_foglimit2_loc, 1e30);
+		glUniform3fv(block_program.eye_loc, 1, glm::value_ptr(eye));
+		glUniform1i(block_program.tick_loc, g_tick);
+		glUniform1f(block_program.foglimit2_loc, 1e30);
 
 		glBindBuffer(GL_ARRAY_BUFFER, block_buffer);
-		glEnableVertexAttribArray(block_pos0_loc);
-		glEnableVertexAttribArray(block_pos1_loc);
-		glEnableVertexAttribArray(block_pos2_loc);
-		glEnableVertexAttribArray(block_pos3_loc);
-		glEnableVertexAttribArray(block_texture_loc);
-		glEnableVertexAttribArray(block_light_loc);
-		glEnableVertexAttribArray(block_plane_loc);
-
-		glVertexAttribIPointer(block_pos0_loc,    3, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->pos[0]);
-		glVertexAttribIPointer(block_pos1_loc,    3, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->pos[1]);
-		glVertexAttribIPointer(block_pos2_loc,    3, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->pos[2]);
-		glVertexAttribIPointer(block_pos3_loc,    3, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->pos[3]);
-		glVertexAttribIPointer(block_texture_loc, 1, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->texture);
-		glVertexAttribIPointer(block_light_loc,   1, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->light);
-		glVertexAttribIPointer(block_plane_loc,   1, GL_UNSIGNED_SHORT, sizeof(WQuad), &((WQuad*)0)->plane);
+		glEnableVertexAttribArray(block_program.word0_loc);
+		glEnableVertexAttribArray(block_program.word1_loc);
+		glVertexAttribIPointer(block_program.word0_loc, 1, GL_UNSIGNED_INT, sizeof(Quad), &((Quad*)0)->word0);
+		glVertexAttribIPointer(block_program.word1_loc, 1, GL_UNSIGNED_INT, sizeof(Quad), &((Quad*)0)->word1);
 
+		// Packed quads are chunk relative, so each palette block is drawn with its own origin
 		const uint palette_blocks = block_count - (uint)Block::water;
-		WQuad quads[3 * palette_blocks];
-		WQuad* e = quads;
+		Quad quads[3 * palette_blocks];
+		Quad* e = quads;
 		FOR(i, palette_blocks) FOR(face, 6)
 		{
 			if (face != 0 && face != 2 && face != 5) continue;
 
 			const int* f = Cube::faces[face];
-			uint8_t light = 255;
-			if (face == 2) light = 127;
-			if (face == 5) light = 127 + 64;
-			if (face == 0) light = 255;
-
-			glm::ivec3 w(128+i, 128-i, 128);
-			FOR(j, 4) e->pos[j] = glm::u16vec3((w + Cube::corner[f[j]]) * 15);
-			e->plane = face << 8;
-			e->light = 65535;
-			e->texture = get_block_texture(Block(i + block_count - palette_blocks), face);
-			e += 1;
+			MeshQuad m;
+			FOR(j, 4) m.pos[j] = glm::u8vec3(Cube::corner[f[j]] * 15);
+			m.plane = (face << 8) | m.pos[0][face / 2];
+			m.light = 65535;
+			m.texture = get_block_texture(Block(i + block_count - palette_blocks), face);
+			*e++ = pack(m);
 		}
 
 		glEnable(GL_BLEND);
-		glm::ivec3 pos(0, 0, 0);
-		glUniform3iv(block_pos_loc, 1, glm::value_ptr(pos));
-		glBufferData(GL_ARRAY_BUFFER, sizeof(WQuad) * 3 * palette_blocks, quads, GL_STREAM_DRAW);
-		glDrawArrays(GL_POINTS, 0, 3 * palette_blocks);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Quad) * 3 * palette_blocks, quads, GL_STREAM_DRAW);
+		FOR(i, palette_blocks)
+		{
+			glm::ivec3 pos(128+i, 128-i, 128);
+			glUniform3iv(block_program.pos_loc, 1, glm::value_ptr(pos));
+			glDrawArrays(GL_POINTS, 3 * i, 3);
+		}
 		glUseProgram(0);
 		glDisable(GL_BLEND);
 
@@ -2594,6 +3528,9 @@ void render_gui()
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vline), vline, GL_STREAM_DRAW);
 		glDrawArrays(GL_LINES, 0, 4);
 	}
+
+	// Palette block name
+	text->Flush();
 }
 
 void OnError(int error, const char* message)
@@ -2647,28 +3584,131 @@ void command_import(char* filename, glm::ivec3 pos, float scale)
 			return;
 		}
 
-		rasterize_mesh(mesh, pos, scale, Block::grass);
-		console.Print("import completed\n");
+		std::vector<glm::vec3> vertices;
+		transform_mesh(mesh, pos, scale, vertices);
+
+		AutoLock(g_mesh_upload.mutex);
+		if (g_mesh_upload.vertices.size() > 0)
+		{
+			console.Print("previous import is still uploading\n");
+			return;
+		}
+		g_mesh_upload.vertices.swap(vertices);
+		g_mesh_upload.sent = 0;
+		g_mesh_upload.block = Block::grass;
 	}).detach();
 }
 
+struct ConsoleVar
+{
+	const char* name;
+	bool* value;
+};
+
+ConsoleVar console_vars[] = { { "collision", &g_collision }, { "batched", &g_batched }, { "occlusion", &g_occlusion_culling }, { "lod", &g_lod }, { "pull", &g_pull } };
+
 void command_set()
 {
-	console.Print("collision = %s\n", g_collision ? "true" : "false");
+	for (ConsoleVar& var : console_vars) console.Print("%s = %s\n", var.name, *var.value ? "true" : "false");
 }
 
 void command_set(Token key, Token value)
 {
-	if (key == "collision")
+	for (ConsoleVar& var : console_vars)
 	{
-		if (value == "true") { g_collision = true; return; }
-		if (value == "false") { g_collision = false; return; }
-		console.Print("error in syntax: set collision (true | false)\n");
-		return;
+		if (key == var.name)
+		{
+			if (value == "true") { *var.value = true; return; }
+			if (value == "false") { *var.value = false; return; }
+			console.Print("error in syntax: set %s (true | false)\n", var.name);
+			return;
+		}
 	}
 	console.Print("unknown var %.*s. type 'set' for list of all vars.", key.second, key.first);
 }
 
+bool parse_block(Token token, Block& block)
+{
+	if (is_integer(token))
+	{
+		int b = parse_int(token);
+		if (b < 0 || b >= block_count) return false;
+		block = Block(b);
+		return true;
+	}
+	FOR(i, block_count) if (token == block_name[i])
+	{
+		block = Block(i);
+		return true;
+	}
+	return false;
+}
+
+bool parse_ivec3(const std::vector<Token>& tokens, int i, glm::ivec3& v)
+{
+	FOR(j, 3) if (!is_integer(tokens[i + j])) return false;
+	v = glm::ivec3(parse_int(tokens[i]), parse_int(tokens[i + 1]), parse_int(tokens[i + 2]));
+	return true;
+}
+
+// Region operations, executed by server. Returns false if <tokens> is not a region command.
+bool command_region(const std::vector<Token>& tokens)
+{
+	glm::ivec3 a, b;
+	Block block, match;
+	if (tokens[0] == "fill")
+	{
+		if (tokens.size() != 8 || !parse_ivec3(tokens, 1, a) || !parse_ivec3(tokens, 4, b) || !parse_block(tokens[7], block))
+		{
+			console.Print("error in syntax: fill <x0> <y0> <z0> <x1> <y1> <z1> <block>\n");
+			return true;
+		}
+		edit_region(RegionOp::Fill, a, b, block);
+		return true;
+	}
+	if (tokens[0] == "sphere")
+	{
+		if (tokens.size() != 6 || !parse_ivec3(tokens, 1, a) || !is_integer(tokens[4]) || !parse_block(tokens[5], block))
+		{
+			console.Print("error in syntax: sphere <x> <y> <z> <radius> <block>\n");
+			return true;
+		}
+		edit_region(RegionOp::Sphere, a, glm::ivec3(parse_int(tokens[4]), 0, 0), block);
+		return true;
+	}
+	if (tokens[0] == "replace")
+	{
+		if (tokens.size() != 9 || !parse_ivec3(tokens, 1, a) || !parse_ivec3(tokens, 4, b) || !parse_block(tokens[7], match) || !parse_block(tokens[8], block))
+		{
+			console.Print("error in syntax: replace <x0> <y0> <z0> <x1> <y1> <z1> <from block> <to block>\n");
+			return true;
+		}
+		edit_region(RegionOp::Replace, a, b, block, match);
+		return true;
+	}
+	if (tokens[0] == "copy")
+	{
+		if (tokens.size() != 7 || !parse_ivec3(tokens, 1, a) || !parse_ivec3(tokens, 4, b))
+		{
+			console.Print("error in syntax: copy <x0> <y0> <z0> <x1> <y1> <z1>\n");
+			return true;
+		}
+		edit_region(RegionOp::Copy, a, b);
+		return true;
+	}
+	if (tokens[0] == "paste")
+	{
+		if (tokens.size() != 4 || !parse_ivec3(tokens, 1, a))
+		{
+			console.Print("error in syntax: paste <x> <y> <z>\n");
+			return true;
+		}
+		edit_region(RegionOp::Paste, a, a);
+		return true;
+	}
+	return false;
+}
+
 void MyConsole::Execute(const char* command, int length)
 {
 	if (command[0] == '/') // shout!
@@ -2696,6 +3736,16 @@ void MyConsole::Execute(const char* command, int length)
 		return;
 	}
 
+	if (command_region(tokens)) return;
+
+	if (tokens[0] == "undo" || tokens[0] == "redo")
+	{
+		// Edits still queued in this frame must reach server first, so that they are undone too
+		client_send_edits();
+		write_text_message(g_send_buffer, "%.*s", tokens[0].second, tokens[0].first);
+		return;
+	}
+
 	if (tokens[0] == "set")
 	{
 		if (tokens.size() == 1) { command_set(); return; }
@@ -2726,8 +3776,61 @@ GLFWwindow* create_window()
 	return window;
 }
 
+void generate_chunk(Blocks& chunk, glm::ivec3 cpos);
+
+// Meshes terrain chunks around origin and times BlockRenderer without any rendering
+void mesh_benchmark(int region)
+{
+	const int Height = 8; // in chunks, starting from z = 0
+	const int N = region * 2 + 2, H = Height + 2; // one chunk of neighbours on each side
+	std::vector<Blocks> blocks(N * N * H);
+	auto at = [&](glm::ivec3 c) -> Blocks& { c += glm::ivec3(region + 1, region + 1, 1); return blocks[(c.z * N + c.y) * N + c.x]; };
+	FOR2(x, -region - 1, region) FOR2(y, -region - 1, region) FOR2(z, -1, Height) generate_chunk(at(glm::ivec3(x, y, z)), glm::ivec3(x, y, z));
+
+	BlockRenderer* renderer = new BlockRenderer;
+	std::vector<Quad> quads;
+	int blended;
+	const int Passes = 8; // 0: unmerged, 1: merged, 2..4: LOD 1..3, 5..7: LOD 1..3 with skirts on all faces
+	const int Repeats = 5; // best time is reported
+	int64_t count[Passes] = {};
+	double ms[Passes];
+	FOR(pass, Passes) FOR(repeat, Repeats)
+	{
+		count[pass] = 0;
+		auto start = std::chrono::steady_clock::now();
+		FOR2(x, -region, region - 1) FOR2(y, -region, region - 1) FOR(z, Height)
+		{
+			glm::ivec3 cpos(x, y, z);
+			if (pass >= 2)
+			{
+				const Blocks* neighbours[6];
+				FOR(face, 6) neighbours[face] = &at(cpos + face_dir[face]);
+				renderer->generate_lod_quads(at(cpos), neighbours, (pass >= 5) ? 63 : 0, (pass - 2) % 3 + 1, quads, blended);
+			}
+			else
+			{
+				const Blocks* chunks[27];
+				FOR(i, 27) chunks[i] = &at(cpos + glm::ivec3(i / 9 - 1, (i / 3) % 3 - 1, i % 3 - 1));
+				renderer->generate_quads(cpos, chunks, nullptr, pass == 1, quads, blended);
+			}
+			count[pass] += quads.size();
+		}
+		double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (repeat == 0 || t < ms[pass]) ms[pass] = t;
+	}
+	delete renderer;
+
+	int chunks = region * region * 4 * Height;
+	const char* name[Passes] = { "unmerged", "merged", "lod 1", "lod 2", "lod 3", "lod 1 skirts", "lod 2 skirts", "lod 3 skirts" };
+	FOR(pass, Passes) fprintf(stderr, "%-12s: %8lld quads, %.3f ms per chunk\n", name[pass], (long long)count[pass], ms[pass] / chunks);
+	fprintf(stderr, "%d chunks, merging: %.3f ms per chunk\n", chunks, (ms[1] - ms[0]) / chunks);
+}
+
 bool g_run_server = true;
 const char* g_connect_to = "localhost";
+int g_physics_benchmark = 0;
+int g_mesh_benchmark = 0;
+bool g_creative_server = false;
 
 bool parse_command_args(int argc, char** argv)
 {
@@ -2750,6 +3853,24 @@ bool parse_command_args(int argc, char** argv)
 			g_connect_to = argv[i+1];
 			i += 1;
 		}
+		else if (strcmp("--creative", argv[i]) == 0)
+		{
+			g_creative_server = true;
+		}
+		else if (strcmp("--physics-benchmark", argv[i]) == 0)
+		{
+			if (i+1 >= argc) return false;
+			g_physics_benchmark = atoi(argv[i+1]);
+			if (g_physics_benchmark <= 0) return false;
+			i += 1;
+		}
+		else if (strcmp("--mesh-benchmark", argv[i]) == 0)
+		{
+			if (i+1 >= argc) return false;
+			g_mesh_benchmark = atoi(argv[i+1]);
+			if (g_mesh_benchmark <= 0) return false;
+			i += 1;
+		}
 		else
 		{
 			return false;
@@ -2768,18 +3889,32 @@ int main(int argc, char** argv)
 
 	if (!parse_command_args(argc, argv))
 	{
-		printf("usage: %s [--server | --join <hostname>]\n", argv[0]);
+		printf("usage: %s [--server [--creative] | --join <hostname> | --physics-benchmark <bodies> | --mesh-benchmark <region>]\n", argv[0]);
 		return 0;
 	}
 
 	CHECK(make_dir("../world"));
 
+	if (g_physics_benchmark > 0)
+	{
+		physics_benchmark(g_physics_benchmark);
+		return 0;
+	}
+
+	if (g_mesh_benchmark > 0)
+	{
+		mesh_benchmark(g_mesh_benchmark);
+		return 0;
+	}
+
+	// Local game always allows creative mode, dedicated server only with --creative
+	uint8_t player_modes = PlayerInput::Creative | PlayerInput::NoCollision;
 	if (!g_connect_to)
 	{
-		server_main();
+		server_main(g_creative_server ? player_modes : 0);
 		return 0;
 	}
-	if (g_run_server) std::thread(server_main).detach();
+	if (g_run_server) std::thread(server_main, player_modes).detach();
 
 	fprintf(stderr, "Connecting to %s:7000 ...\n", g_connect_to);
 	int retries = 0;
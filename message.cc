@@ -27,3 +27,100 @@ void write_text_message(SocketBuffer& send, const char* fmt, ...)
 	send.write(&message, sizeof(MessageText));
 	send.write(&buffer, length);
 }
+
+MessagePlayerInput* read_player_input_message(SocketBuffer& recv)
+{
+	if (recv.size() < sizeof(MessagePlayerInput)) return nullptr;
+	MessagePlayerInput* message = reinterpret_cast<MessagePlayerInput*>(recv.data());
+	assert(message->type == MessageType::PlayerInput);
+	uint size = sizeof(MessagePlayerInput) + sizeof(InputRun) * (uint)message->count;
+	if (recv.size() < size) return nullptr;
+	recv.read_message(size);
+	return message;
+}
+
+void write_player_input_message(SocketBuffer& send, uint32_t seq, float yaw, float pitch, const InputRun* runs, uint count)
+{
+	assert(count <= 255);
+	MessagePlayerInput message;
+	message.type = MessageType::PlayerInput;
+	message.seq = seq;
+	message.yaw = yaw;
+	message.pitch = pitch;
+	message.count = count;
+	send.ensure_space(sizeof(MessagePlayerInput) + sizeof(InputRun) * count);
+	send.write(&message, sizeof(MessagePlayerInput));
+	send.write(runs, sizeof(InputRun) * count);
+}
+
+MessageAvatarUpdates* read_avatar_updates_message(SocketBuffer& recv)
+{
+	if (recv.size() < sizeof(MessageAvatarUpdates)) return nullptr;
+	MessageAvatarUpdates* message = reinterpret_cast<MessageAvatarUpdates*>(recv.data());
+	assert(message->type == MessageType::AvatarUpdates);
+	uint size = sizeof(MessageAvatarUpdates) + sizeof(AvatarUpdate) * (uint)message->update_count + (uint)message->remove_count;
+	if (recv.size() < size) return nullptr;
+	recv.read_message(size);
+	return message;
+}
+
+void write_avatar_updates_message(SocketBuffer& send, glm::ivec3 cpos, const AvatarUpdate* updates, uint update_count, const uint8_t* removed, uint remove_count)
+{
+	assert(update_count <= 255 && remove_count <= 255);
+	MessageAvatarUpdates message;
+	message.type = MessageType::AvatarUpdates;
+	FOR(i, 3) message.cpos[i] = cpos[i];
+	message.update_count = update_count;
+	message.remove_count = remove_count;
+	send.ensure_space(sizeof(MessageAvatarUpdates) + sizeof(AvatarUpdate) * update_count + remove_count);
+	send.write(&message, sizeof(MessageAvatarUpdates));
+	send.write(updates, sizeof(AvatarUpdate) * update_count);
+	send.write(removed, remove_count);
+}
+
+MessageMeshTriangles* read_mesh_triangles_message(SocketBuffer& recv)
+{
+	if (recv.size() < sizeof(MessageMeshTriangles)) return nullptr;
+	MessageMeshTriangles* message = reinterpret_cast<MessageMeshTriangles*>(recv.data());
+	assert(message->type == MessageType::MeshTriangles);
+	uint size = sizeof(MessageMeshTriangles) + sizeof(float) * 9 * (uint)message->count;
+	if (recv.size() < size) return nullptr;
+	recv.read_message(size);
+	return message;
+}
+
+void write_mesh_triangles_message(SocketBuffer& send, const glm::vec3* vertices, uint count)
+{
+	assert(count <= MeshTrianglesPerMessage);
+	MessageMeshTriangles message;
+	message.type = MessageType::MeshTriangles;
+	message.count = count;
+	static_assert(sizeof(glm::vec3) == sizeof(float) * 3, "");
+	send.ensure_space(sizeof(MessageMeshTriangles) + sizeof(float) * 9 * count);
+	send.write(&message, sizeof(MessageMeshTriangles));
+	send.write(vertices, sizeof(float) * 9 * count);
+}
+
+MessageEditBatch* read_edit_batch_message(SocketBuffer& recv)
+{
+	if (recv.size() < sizeof(MessageEditBatch)) return nullptr;
+	MessageEditBatch* message = reinterpret_cast<MessageEditBatch*>(recv.data());
+	assert(message->type == MessageType::EditBatch);
+	uint size = sizeof(MessageEditBatch) + sizeof(BlockEdit) * (uint)message->edit_count + sizeof(RegionEdit) * (uint)message->region_count;
+	if (recv.size() < size) return nullptr;
+	recv.read_message(size);
+	return message;
+}
+
+void write_edit_batch_message(SocketBuffer& send, const BlockEdit* edits, uint edit_count, const RegionEdit* regions, uint region_count)
+{
+	assert(edit_count <= MaxBlockEditsPerMessage && region_count <= 255);
+	MessageEditBatch message;
+	message.type = MessageType::EditBatch;
+	message.edit_count = edit_count;
+	message.region_count = region_count;
+	send.ensure_space(sizeof(MessageEditBatch) + sizeof(BlockEdit) * edit_count + sizeof(RegionEdit) * region_count);
+	send.write(&message, sizeof(MessageEditBatch));
+	send.write(edits, sizeof(BlockEdit) * edit_count);
+	send.write(regions, sizeof(RegionEdit) * region_count);
+}
@@ -1,13 +1,20 @@
 #pragma once
 
 #include "block.hh"
+#include "physics.hh"
 
 enum class MessageType : uint8_t
 {
 	Text = 0,
-	AvatarState = 1,
+	AvatarUpdates = 1,
 	ChunkState = 2,
-	ServerStatus = 3
+	ServerStatus = 3,
+	PlayerInput = 4,
+	PlayerAck = 5,
+	PlayerSpawn = 6,
+	MeshTriangles = 7,
+	MeshImport = 8,
+	EditBatch = 9
 };
 
 struct MessageText
@@ -17,12 +24,142 @@ struct MessageText
 	char text[0]; // <size> bytes follow!
 } __attribute__((packed));
 
-struct MessageAvatarState
+// Position is in 1/AvatarPositionScale of block, relative to origin of receiver's chunk (MessageAvatarUpdates::cpos)
+const int AvatarPositionScale = 32;
+
+// Plain arrays instead of glm vectors on the wire: packed attribute is ignored for glm members (which keep padding)
+struct AvatarUpdate
 {
-	MessageType type;
 	uint8_t id;
-	glm::vec3 position;
+	int16_t position[3];
+	uint16_t orientation; // yaw 10 bits | pitch 6 bits
+} __attribute__((packed));
+static_assert(sizeof(AvatarUpdate) == 9, "AvatarUpdate must be packed");
+
+inline uint16_t pack_orientation(float yaw, float pitch)
+{
+	int y = int(std::round(yaw * (1024 / (2 * M_PI)))) & 1023;
+	int p = glm::clamp<int>(std::round((pitch / M_PI + 0.5) * 63), 0, 63);
+	return (y << 6) | p;
+}
+
+inline void unpack_orientation(uint16_t orientation, float& yaw, float& pitch)
+{
+	yaw = (orientation >> 6) * (2 * M_PI / 1024);
+	pitch = ((orientation & 63) / 63.0 - 0.5) * M_PI;
+}
+
+// Server -> client: all avatar updates of one tick for this receiver, then ids of avatars that went out of its range.
+// Removals apply before updates (id can be reused by a new avatar within the same tick).
+struct MessageAvatarUpdates
+{
+	MessageType type;
+	int32_t cpos[3];
+	uint8_t update_count;
+	uint8_t remove_count;
+	AvatarUpdate updates[0]; // <update_count> updates follow, then <remove_count> uint8_t ids!
+} __attribute__((packed));
+static_assert(sizeof(MessageAvatarUpdates) == 15, "MessageAvatarUpdates must be packed");
+
+// Client -> server: inputs for consecutive PhysicsDt steps, starting with step <seq>
+struct InputRun
+{
+	PlayerInput input;
+	uint8_t repeat; // number of consecutive steps with same input
+} __attribute__((packed));
+
+struct MessagePlayerInput
+{
+	MessageType type;
+	uint32_t seq;
 	float yaw, pitch;
+	uint8_t count;
+	InputRun runs[0]; // <count> runs follow!
+} __attribute__((packed));
+
+// Server -> client: authoritative state after all steps before <seq>
+struct MessagePlayerAck
+{
+	MessageType type;
+	uint8_t spawn_id; // of last MessagePlayerSpawn
+	uint32_t seq;
+	float position[3];
+	float velocity[3];
+	uint8_t on_ground;
+} __attribute__((packed));
+
+// Client -> server: state is reset by client (spawn, mode change), next input step is <seq>. Server takes <position> only
+// on first spawn (and stops player on later ones), and simulates at most as many input steps as its clock allows.
+struct MessagePlayerSpawn
+{
+	MessageType type;
+	uint8_t spawn_id; // echoed in acks, so that client can ignore acks of states before reset
+	uint32_t seq;
+	float position[3];
+	float velocity[3];
+} __attribute__((packed));
+
+// Client -> server: part of mesh upload, triangles in world coordinates (in blocks)
+const uint MeshTrianglesPerMessage = 4096;
+
+struct MessageMeshTriangles
+{
+	MessageType type;
+	uint16_t count;
+	float vertices[0]; // 3 * <count> vertices (x y z) follow!
+} __attribute__((packed));
+
+// Client -> server: voxelize all triangles uploaded so far into <block>, one import per player at a time.
+// Mesh must be near player and at most 512 blocks on each axis, server replies with text message if rejected or truncated.
+struct MessageMeshImport
+{
+	MessageType type;
+	Block block;
+} __attribute__((packed));
+
+// Client -> server: single block edits and region operations, applied by server over several ticks (after earlier edits,
+// imports and undos of the player) as one undo step.
+// Edits must be near player and regions at most 256 blocks on each axis, server replies with text message for each rejected one.
+struct BlockEdit
+{
+	int32_t pos[3];
+	Block block;
+
+	glm::ivec3 position() const { return glm::ivec3(pos[0], pos[1], pos[2]); }
+	void set_position(glm::ivec3 p) { FOR(i, 3) pos[i] = p[i]; }
+} __attribute__((packed));
+static_assert(sizeof(BlockEdit) == 13, "BlockEdit must be packed");
+
+enum class RegionOp : uint8_t
+{
+	Fill = 0, // set box <a>..<b> to <block>
+	Sphere = 1, // set sphere around <a> with radius <b.x> to <block>
+	Replace = 2, // in box <a>..<b> replace <match> with <block>
+	Copy = 3, // copy box <a>..<b> to sender's clipboard
+	Paste = 4 // paste sender's clipboard with min corner at <a>
+};
+
+struct RegionEdit
+{
+	RegionOp op;
+	Block block;
+	Block match;
+	int32_t a[3], b[3]; // box corners are inclusive
+
+	glm::ivec3 corner_a() const { return glm::ivec3(a[0], a[1], a[2]); }
+	glm::ivec3 corner_b() const { return glm::ivec3(b[0], b[1], b[2]); }
+	void set_corners(glm::ivec3 pa, glm::ivec3 pb) { FOR(i, 3) { a[i] = pa[i]; b[i] = pb[i]; } }
+} __attribute__((packed));
+static_assert(sizeof(RegionEdit) == 27, "RegionEdit must be packed");
+
+const uint MaxBlockEditsPerMessage = 16384;
+
+struct MessageEditBatch
+{
+	MessageType type;
+	uint16_t edit_count;
+	uint8_t region_count;
+	BlockEdit edits[0]; // <edit_count> edits follow, then <region_count> RegionEdits!
 } __attribute__((packed));
 
 struct MessageChunkState
@@ -48,3 +185,11 @@ struct MessageServerStatus
 struct SocketBuffer;
 MessageText* read_text_message(SocketBuffer& recv);
 void write_text_message(SocketBuffer& send, const char* fmt, ...);
+MessagePlayerInput* read_player_input_message(SocketBuffer& recv);
+MessageAvatarUpdates* read_avatar_updates_message(SocketBuffer& recv);
+void write_avatar_updates_message(SocketBuffer& send, glm::ivec3 cpos, const AvatarUpdate* updates, uint update_count, const uint8_t* removed, uint remove_count);
+void write_player_input_message(SocketBuffer& send, uint32_t seq, float yaw, float pitch, const InputRun* runs, uint count);
+MessageMeshTriangles* read_mesh_triangles_message(SocketBuffer& recv);
+void write_mesh_triangles_message(SocketBuffer& send, const glm::vec3* vertices, uint count);
+MessageEditBatch* read_edit_batch_message(SocketBuffer& recv);
+void write_edit_batch_message(SocketBuffer& send, const BlockEdit* edits, uint edit_count, const RegionEdit* regions, uint region_count);
@@ -0,0 +1,526 @@
+#include "physics.hh"
+
+int NeighborBit(int dx, int dy, int dz)
+{
+	return 1 << ((dx + 1) + (dy + 1) * 3 + (dz + 1) * 9);
+}
+
+bool IsVertexFree(uint neighbors, int dx, int dy, int dz)
+{
+	assert(abs(dx) + abs(dy) + abs(dz) == 3);
+	uint mask = NeighborBit(dx, dy, dz);
+	mask |= NeighborBit(0, dy, dz) | NeighborBit(dx, 0, dz) | NeighborBit(dx, dy, 0);
+	mask |= NeighborBit(0, 0, dz) | NeighborBit(dx, 0, 0) | NeighborBit(0, dy, 0);
+	return (neighbors & mask) == 0;
+}
+
+bool IsEdgeFree(uint neighbors, int dx, int dy, int dz)
+{
+	assert(abs(dx) + abs(dy) + abs(dz) == 2);
+	uint mask = NeighborBit(dx, dy, dz);
+	mask |= NeighborBit(0, dy, dz) | NeighborBit(dx, 0, dz) | NeighborBit(dx, dy, 0);
+	return (neighbors & mask) == 0;
+}
+
+int Resolve(glm::vec3& delta, float k, float x, float y, float z)
+{
+	glm::vec3 d(x, y, z);
+	float ds = sqr(d);
+	if (ds < 1e-6) return -1;
+	delta = d * (k / sqrtf(ds) - 1);
+	return 1;
+}
+
+// Move sphere so that it is not coliding with cube
+//
+// Neighbors is 3x3x3 matrix of 27 bits representing nearby cubes.
+// Used to turn off vertices and edges that are not exposed.
+int sphere_vs_cube(glm::vec3& center, float radius, glm::ivec3 cube, int neighbors)
+{
+	float e = 0.5;
+	float x = center.x - cube.x - e;
+	float y = center.y - cube.y - e;
+	float z = center.z - cube.z - e;
+	float k = e + radius;
+
+	if (x >= k || x <= -k || y >= k || y <= -k || z >= k || z <= -k) return 0;
+
+	float s2 = sqr(radius + sqrtf(2) / 2);
+	if (x*x + y*y >= s2 || x*x + z*z >= s2 || y*y + z*z >= s2) return 0;
+
+	if (x*x + y*y + z*z >= sqr(radius + sqrt(3) / 2)) return 0;
+
+	// if center outside cube
+	if (x > +e)
+	{
+		if (y > +e)
+		{
+			if (z > +e) return IsVertexFree(neighbors, 1, 1, +1) ? Resolve(center, radius, x - e, y - e, z - e) : -1;
+			if (z < -e) return IsVertexFree(neighbors, 1, 1, -1) ? Resolve(center, radius, x - e, y - e, z + e) : -1;
+			return IsEdgeFree(neighbors, 1, 1, 0) ? Resolve(center, radius, x - e, y - e, 0) : -1;
+		}
+		if (y < -e)
+		{
+			if (z > +e) return IsVertexFree(neighbors, 1, -1, +1) ? Resolve(center, radius, x - e, y + e, z - e) : -1;
+			if (z < -e) return IsVertexFree(neighbors, 1, -1, -1) ? Resolve(center, radius, x - e, y + e, z + e) : -1;
+			return IsEdgeFree(neighbors, 1, -1, 0) ? Resolve(center, radius, x - e, y + e, 0) : -1;
+		}
+
+		if (z > +e) return IsEdgeFree(neighbors, 1, 0, +1) ? Resolve(center, radius, x - e, 0, z - e) : -1;
+		if (z < -e) return IsEdgeFree(neighbors, 1, 0, -1) ? Resolve(center, radius, x - e, 0, z + e) : -1;
+		center.x += radius - x + e;
+		return 1;
+	}
+
+	if (x < -e)
+	{
+		if (y > +e)
+		{
+			if (z > +e) return IsVertexFree(neighbors, -1, 1, +1) ? Resolve(center, radius, x + e, y - e, z - e) : -1;
+			if (z < -e) return IsVertexFree(neighbors, -1, 1, -1) ? Resolve(center, radius, x + e, y - e, z + e) : -1;
+			return IsEdgeFree(neighbors, -1, 1, 0) ? Resolve(center, radius, x + e, y - e, 0) : -1;
+		}
+		if (y < -e)
+		{
+			if (z > +e) return IsVertexFree(neighbors, -1, -1, +1) ? Resolve(center, radius, x + e, y + e, z - e) : -1;
+			if (z < -e) return IsVertexFree(neighbors, -1, -1, -1) ? Resolve(center, radius, x + e, y + e, z + e) : -1;
+			return IsEdgeFree(neighbors, -1, -1, 0) ? Resolve(center, radius, x + e, y + e, 0) : -1;
+		}
+
+		if (z > +e) return IsEdgeFree(neighbors, -1, 0, +1) ? Resolve(center, radius, x + e, 0, z - e) : -1;
+		if (z < -e) return IsEdgeFree(neighbors, -1, 0, -1) ? Resolve(center, radius, x + e, 0, z + e) : -1;
+		center.x += -radius - x - e;
+		return 1;
+	}
+
+	if (y > +e)
+	{
+		if (z > +e) return IsEdgeFree(neighbors, 0, 1, +1) ? Resolve(center, radius, 0, y - e, z - e) : -1;
+		if (z < -e) return IsEdgeFree(neighbors, 0, 1, -1) ? Resolve(center, radius, 0, y - e, z + e) : -1;
+		center.y += radius - y + e;
+		return 1;
+	}
+	if (y < -e)
+	{
+		if (z > +e) return IsEdgeFree(neighbors, 0, -1, +1) ? Resolve(center, radius, 0, y + e, z - e) : -1;
+		if (z < -e) return IsEdgeFree(neighbors, 0, -1, -1) ? Resolve(center, radius, 0, y + e, z + e) : -1;
+		center.y += -radius - y - e;
+		return 1;
+	}
+
+	if (z > +e)
+	{
+		center.z +=  radius - z + e;
+		return 1;
+	}
+	if (z < -e)
+	{
+		center.z += -radius - z - e;
+		return 1;
+	}
+
+	// center inside cube
+	float ax = fabs(x), ay = fabs(y);
+	if (ax > ay)
+	{
+		if (ax > fabs(z)) { center.x += (x > 0 ? k : -k) - x; return 1; }
+	}
+	else
+	{
+		if (ay > fabs(z)) { center.y += (y > 0 ? k : -k) - y; return 1; }
+	}
+	center.z += (z > 0 ? k : -k) - z;
+	return 1;
+}
+
+int cuboid_vs_cube(glm::vec3 center, glm::vec3 radius, glm::ivec3 cube, glm::vec3& delta)
+{
+	float e = 0.5;
+	float x = center.x - cube.x - e;
+	float y = center.y - cube.y - e;
+	float z = center.z - cube.z - e;
+
+	glm::vec3 k = radius + e;
+
+	if (x >= k.x || x <= -k.x || y >= k.y || y <= -k.y || z >= k.z || z <= -k.z) return 0;
+
+	float dx = (x > 0 ? k.x : -k.x) - x;
+	float dy = (y > 0 ? k.y : -k.y) - y;
+	float dz = (z > 0 ? k.z : -k.z) - z;
+
+	if (std::abs(dx) < std::abs(dy))
+	{
+		if (std::abs(dx) < std::abs(dz))
+		{
+			delta = glm::vec3(dx, 0, 0);
+		}
+		else
+		{
+			delta = glm::vec3(0, 0, dz);
+		}
+	}
+	else
+	{
+		if (std::abs(dy) < std::abs(dz))
+		{
+			delta = glm::vec3(0, dy, 0);
+		}
+		else
+		{
+			delta = glm::vec3(0, 0, dz);
+		}
+	}
+	return 1;
+}
+
+// Move cylinder so that it is not coliding with cube.
+// Cylinder is always facing up.
+//
+// Neighbors is 3x3x3 (only 4 corners are used) matrix of bits representing nearby cubes.
+// Used to turn off edges that are not exposed.
+int cylinder_vs_cube(glm::vec3 center, float radius, float /*half*/height, glm::ivec3 cube, glm::vec3& delta, int neighbors)
+{
+	float e = 0.5;
+	float x = center.x - cube.x - e;
+	float y = center.y - cube.y - e;
+	float z = center.z - cube.z - e;
+	float kr = e + radius;
+	float kh = e + height;
+
+	if (x >= kr || x <= -kr || y >= kr || y <= -kr || z >= kh || z <= -kh) return 0;
+
+	float s2 = sqr(radius + sqrtf(2) / 2);
+	if (x*x + y*y >= s2) return 0;
+
+	// Compute delta XY
+	float dxy = 0;
+	if (x > +e)
+	{
+		if (y > +e)
+		{
+			if (!IsEdgeFree(neighbors, 1, 1, 0) || !Resolve(delta, radius, x - e, y - e, 0)) return -1;
+			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
+		}
+		else if (y < -e)
+		{
+			if (!IsEdgeFree(neighbors, 1, -1, 0) || !Resolve(delta, radius, x - e, y + e, 0)) return -1;
+			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
+		}
+		else
+		{
+			delta = glm::vec3(kr - x, 0, 0);
+			dxy = delta.x;
+		}
+	}
+	else if (x < -e)
+	{
+		if (y > +e)
+		{
+			if (!IsEdgeFree(neighbors, -1, 1, 0) || !Resolve(delta, radius, x + e, y - e, 0)) return -1;
+			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
+		}
+		else if (y < -e)
+		{
+			if (!IsEdgeFree(neighbors, -1, -1, 0) || !Resolve(delta, radius, x + e, y + e, 0)) return -1;
+			dxy = sqrt(delta.x * delta.x + delta.y * delta.y);
+		}
+		else
+		{
+			delta = glm::vec3(-kr - x, 0, 0);
+			dxy = -delta.x;
+		}
+	}
+	else
+	{
+		if (y > +e)
+		{
+			delta = glm::vec3(0, kr - y, 0);
+			dxy = delta.y;
+		}
+		else if (y < -e)
+		{
+			delta = glm::vec3(0, -kr - y, 0);
+			dxy = -delta.y;
+		}
+		else
+		{
+			// move either by X or Y, depending which one is less
+			float dx = (x > 0 ? kr : -kr) - x;
+			float dy = (y > 0 ? kr : -kr) - y;
+			if (std::abs(dx) < std::abs(dy))
+			{
+				delta = glm::vec3(dx, 0, 0);
+				dxy = std::abs(dx);
+			}
+			else
+			{
+				delta = glm::vec3(0, dy, 0);
+				dxy = std::abs(dy);
+			}
+		}
+	}
+
+	// Compute delta Z
+	float dz = (z > 0 ? kh : -kh) - z;
+	if (std::abs(dz) < dxy) delta = glm::vec3(0, 0, dz);
+	return 1;
+}
+
+glm::vec3 gravity(glm::vec3 pos)
+{
+	return glm::vec3(0, 0, -30);
+
+	/*glm::vec3 dir = glm::vec3(MoonCenter) - pos;
+	double dist2 = glm::dot(dir, dir);
+	double a = 10000000;
+
+	if (dist2 > MoonRadius * MoonRadius)
+	{
+		return dir * (float)(a / (sqrt(dist2) * dist2));
+	}
+	else
+	{
+		return dir * (float)(a / (MoonRadius * MoonRadius * MoonRadius));
+	}*/
+}
+
+
+void SolidityMask::gather(glm::ivec3 c, IsSolid is_solid)
+{
+	center = c;
+	FOR(z, 5) FOR(y, 5)
+	{
+		uint8_t row = 0;
+		FOR(x, 5) if (is_solid(c + glm::ivec3(x - 2, y - 2, z - 2))) row |= 1 << x;
+		rows[z][y] = row;
+	}
+}
+
+// gather(mask, center) fills SolidityMask, collide(position, cube, delta, neighbors) returns 1 and sets <delta> if body
+// needs to be pushed out of <cube>
+template<typename Gather, typename Collide>
+static bool resolve_collisions(glm::vec3& position, glm::vec3& velocity, const Gather& gather, const Collide& collide)
+{
+	bool on_ground = false;
+	SolidityMask solidity;
+	FOR(i, 2)
+	{
+		// Resolve all collisions simultaneously
+		glm::ivec3 p = glm::ivec3(glm::floor(position));
+		if (i == 0 || p != solidity.center) gather(solidity, p);
+		glm::vec3 sum(0, 0, 0);
+		int c = 0;
+		FOR2(x, p.x - 1, p.x + 1) FOR2(y, p.y - 1, p.y + 1) FOR2(z, p.z - 1, p.z + 1)
+		{
+			glm::ivec3 cube(x, y, z);
+			if (!solidity.solid(cube)) continue;
+			glm::vec3 delta;
+			if (1 == collide(position, cube, /*out*/delta, solidity.neighbors(cube)))
+			{
+				sum += delta;
+				c += 1;
+			}
+		}
+		if (c == 0)	break;
+		float sum2 = glm::length2(sum);
+		if (sum2 == 0) break;
+
+		glm::vec3 normal = sum * glm::inversesqrt(sum2);
+		float d = glm::dot(normal, velocity);
+		if (d < 0) velocity -= d * normal;
+		if (glm::dot(normal, glm::normalize(gravity(position))) < -0.9) on_ground = true;
+		position += sum / (float)c;
+	}
+	return on_ground;
+}
+
+template<typename Gather>
+static bool resolve_cylinder_collisions(glm::vec3& position, glm::vec3& velocity, float radius, float half_height, const Gather& gather)
+{
+	return resolve_collisions(position, velocity, gather, [radius, half_height](glm::vec3 p, glm::ivec3 cube, glm::vec3& delta, int neighbors)
+	{
+		return cylinder_vs_cube(p, radius, half_height, cube, delta, neighbors);
+	});
+}
+
+template<typename Gather>
+static bool resolve_box_collisions(glm::vec3& position, glm::vec3& velocity, glm::vec3 half_size, const Gather& gather)
+{
+	return resolve_collisions(position, velocity, gather, [half_size](glm::vec3 p, glm::ivec3 cube, glm::vec3& delta, int neighbors)
+	{
+		return cuboid_vs_cube(p, half_size, cube, delta);
+	});
+}
+
+bool resolve_collisions(glm::vec3& position, glm::vec3& velocity, float radius, float half_height, IsSolid is_solid)
+{
+	return resolve_cylinder_collisions(position, velocity, radius, half_height, [is_solid](SolidityMask& mask, glm::ivec3 c) { mask.gather(c, is_solid); });
+}
+
+bool resolve_cuboid_collisions(glm::vec3& position, glm::vec3& velocity, glm::vec3 half_size, IsSolid is_solid)
+{
+	return resolve_box_collisions(position, velocity, half_size, [is_solid](SolidityMask& mask, glm::ivec3 c) { mask.gather(c, is_solid); });
+}
+
+// =============
+
+const float player_acc = 35;
+const float player_jump_dv = 15;
+const float player_max_vel = 10;
+
+void simulate_player(PlayerState& s, PlayerInput input, IsSolid is_solid, IsWater is_water)
+{
+	glm::vec3 dir = input.direction();
+	if (glm::length2(dir) > 1) dir = glm::normalize(dir);
+	bool creative = input.flags & PlayerInput::Creative;
+	const float dt = PhysicsDt;
+
+	if (creative)
+	{
+		s.position += dir * (dt * 20);
+	}
+	else
+	{
+		bool jump = false;
+		if (s.on_ground && (input.flags & PlayerInput::Jump))
+		{
+			s.velocity += glm::normalize(-gravity(s.position)) * player_jump_dv;
+			jump = true;
+		}
+
+		bool underwater = is_water(glm::ivec3(glm::floor(s.position)));
+
+		if ((s.on_ground || underwater) && !jump)
+		{
+			if (dir.x != 0 || dir.y != 0 || dir.z != 0)
+			{
+				float d = glm::dot(dir, s.velocity);
+				glm::vec3 a = dir * d;
+				glm::vec3 b = s.velocity - a;
+				float p = dt * player_acc;
+
+				// Brake on side-velocity
+				float b_len = glm::length(b);
+				if (b_len <= p)
+				{
+					s.velocity -= b;
+					p -= b_len;
+
+					if (glm::length(a) > player_max_vel)
+					{
+						// Brake on velocity along running direction
+						s.velocity -= glm::normalize(a) * p;
+					}
+					else
+					{
+						glm::vec3 v = s.velocity + dir * p;
+						float v2 = glm::length2(v);
+						if (v2 < glm::length2(s.velocity) || v2 < player_max_vel * player_max_vel) s.velocity = v;
+					}
+				}
+				else
+				{
+					s.velocity -= glm::normalize(b) * p;
+				}
+			}
+			else
+			{
+				float v = glm::length(s.velocity);
+				if (v <= dt * player_acc)
+				{
+					s.velocity = glm::vec3(0, 0, 0);
+				}
+				else
+				{
+					s.velocity -= glm::normalize(s.velocity) * (dt * player_acc);
+				}
+			}
+		}
+		if (!underwater) s.velocity += gravity(s.position) * dt;
+		s.position += s.velocity * dt;
+	}
+
+	s.on_ground = false;
+	if ((input.flags & PlayerInput::NoCollision) && creative) return;
+	s.on_ground = resolve_collisions(s.position, s.velocity, PlayerRadius, PlayerRadius * 2, is_solid);
+}
+
+// =============
+
+uint Bodies::add(glm::vec3 pos, glm::vec3 vel, float radius, float half_height, uint8_t f)
+{
+	position.push_back(pos);
+	velocity.push_back(vel);
+	extent.push_back(glm::vec3(radius, radius, half_height));
+	flags.push_back(f & ~Cuboid);
+	return position.size() - 1;
+}
+
+uint Bodies::add_cuboid(glm::vec3 pos, glm::vec3 vel, glm::vec3 half_size, uint8_t f)
+{
+	position.push_back(pos);
+	velocity.push_back(vel);
+	extent.push_back(half_size);
+	flags.push_back(f | Cuboid);
+	return position.size() - 1;
+}
+
+void Bodies::remove(uint index)
+{
+	position[index] = position.back();
+	velocity[index] = velocity.back();
+	extent[index] = extent.back();
+	flags[index] = flags.back();
+	position.pop_back();
+	velocity.pop_back();
+	extent.pop_back();
+	flags.pop_back();
+}
+
+void Bodies::clear()
+{
+	position.clear();
+	velocity.clear();
+	extent.clear();
+	flags.clear();
+}
+
+void Bodies::step(float dt, GatherSolid gather)
+{
+	const uint n = size();
+	glm::vec3* pos = position.data();
+	glm::vec3* vel = velocity.data();
+	uint8_t* f = flags.data();
+
+	// Each step a different 1/SleepCheckSteps of sleeping bodies is stepped again
+	steps += 1;
+	for (uint i = steps % SleepCheckSteps; i < n; i += SleepCheckSteps) f[i] &= ~Sleeping;
+
+	// Integrate all bodies first, then resolve collisions body by body
+	FOR(i, n)
+	{
+		if (!(f[i] & (NoGravity | Sleeping))) vel[i] += gravity(pos[i]) * dt;
+	}
+	FOR(i, n) if (!(f[i] & Sleeping)) pos[i] += vel[i] * dt;
+
+	FOR(i, n)
+	{
+		if (f[i] & Sleeping) continue;
+		bool on_ground = (f[i] & Cuboid) ? resolve_box_collisions(pos[i], vel[i], extent[i], gather) : resolve_cylinder_collisions(pos[i], vel[i], extent[i].x, extent[i].z, gather);
+		f[i] = on_ground ? (f[i] | OnGround) : (f[i] & ~OnGround);
+		if (on_ground && glm::length2(vel[i]) < 1e-6f)
+		{
+			vel[i] = glm::vec3(0, 0, 0);
+			f[i] |= Sleeping;
+		}
+	}
+}
+
+void Bodies::wake(glm::vec3 lo, glm::vec3 hi)
+{
+	FOR(i, size())
+	{
+		glm::vec3 p = position[i];
+		if (p.x >= lo.x && p.y >= lo.y && p.z >= lo.z && p.x <= hi.x && p.y <= hi.y && p.z <= hi.z) flags[i] &= ~Sleeping;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "util.hh"
+
+// Neighbors is 3x3x3 matrix of 27 bits representing nearby cubes (see NeighborBit).
+int NeighborBit(int dx, int dy, int dz);
+int sphere_vs_cube(glm::vec3& center, float radius, glm::ivec3 cube, int neighbors);
+int cuboid_vs_cube(glm::vec3 center, glm::vec3 radius, glm::ivec3 cube, glm::vec3& delta);
+int cylinder_vs_cube(glm::vec3 center, float radius, float /*half*/height, glm::ivec3 cube, glm::vec3& delta, int neighbors);
+
+glm::vec3 gravity(glm::vec3 pos);
+
+// Map query used by physics. Cubes in chunks that are not loaded should be reported as solid.
+typedef bool (*IsSolid)(glm::ivec3 cube);
+typedef bool (*IsWater)(glm::ivec3 cube);
+
+// Solid cubes in 5x5x5 box around <center>, gathered once per physics substep instead of querying map per cube.
+// Covers 3x3x3 cubes around body and neighbors of each of them.
+struct SolidityMask
+{
+	glm::ivec3 center;
+	uint8_t rows[5][5]; // [z][y], bit x
+
+	void gather(glm::ivec3 c, IsSolid is_solid);
+
+	// <cube> must be within 2 of center
+	bool solid(glm::ivec3 cube) const
+	{
+		glm::ivec3 r = cube - center + 2;
+		return (rows[r.z][r.y] >> r.x) & 1;
+	}
+
+	// NeighborBit() mask of 3x3x3 cubes around <cube>, which must be within 1 of center
+	int neighbors(glm::ivec3 cube) const
+	{
+		glm::ivec3 r = cube - center + 2;
+		int n = 0;
+		FOR(dz, 3) FOR(dy, 3) n |= ((rows[r.z + dz - 1][r.y + dy - 1] >> (r.x - 1)) & 7) << (dy * 3 + dz * 9);
+		return n;
+	}
+};
+
+// Fills <mask> for box around <center>, like SolidityMask::gather() but map can read its chunks directly
+typedef void (*GatherSolid)(SolidityMask& mask, glm::ivec3 center);
+
+// Push upright cylinder out of solid cubes and remove velocity into them. Returns true if standing on ground.
+// Only 3x3x3 cubes around center are tested, so radius must be under 0.5 and half height under 1.
+bool resolve_collisions(glm::vec3& position, glm::vec3& velocity, float radius, float half_height, IsSolid is_solid);
+// Same for axis aligned box, <half_size> must be under 1 on each axis.
+bool resolve_cuboid_collisions(glm::vec3& position, glm::vec3& velocity, glm::vec3 half_size, IsSolid is_solid);
+
+// Fixed simulation step of players and bodies, same on client and server
+const float PhysicsDt = 0.008f;
+
+// Player input for one PhysicsDt step. Players are simulated from inputs on both client (prediction) and server.
+struct PlayerInput
+{
+	enum Flags : uint8_t { Jump = 1, Creative = 2, NoCollision = 4 };
+
+	int8_t dir[3]; // movement direction as unit vector * 127 (quantized on client, so prediction matches server), longer is normalized
+	uint8_t flags;
+
+	glm::vec3 direction() const { return glm::vec3(dir[0], dir[1], dir[2]) / 127.0f; }
+	void set_direction(glm::vec3 d) { FOR(i, 3) dir[i] = int8_t(std::round(d[i] * 127.0f)); }
+	bool operator==(const PlayerInput& o) const { return dir[0] == o.dir[0] && dir[1] == o.dir[1] && dir[2] == o.dir[2] && flags == o.flags; }
+} __attribute__((packed));
+static_assert(sizeof(PlayerInput) == 4, "PlayerInput must be packed");
+
+struct PlayerState
+{
+	glm::vec3 position;
+	glm::vec3 velocity;
+	bool on_ground;
+};
+
+const float PlayerRadius = 0.48;
+
+void simulate_player(PlayerState& s, PlayerInput input, IsSolid is_solid, IsWater is_water);
+
+// Moving bodies (upright cylinders or axis aligned cuboids), stored as structure of arrays so that integration runs
+// over tightly packed vectors, and stepped together in one batch. Bodies resting on ground sleep: they are skipped,
+// except for a step every SleepCheckSteps (in case ground under them changed) or when woken up by map edit.
+struct Bodies
+{
+	enum Flags : uint8_t { OnGround = 1, NoGravity = 2, Cuboid = 4, Sleeping = 8 };
+	static const uint SleepCheckSteps = 16;
+
+	std::vector<glm::vec3> position;
+	std::vector<glm::vec3> velocity;
+	std::vector<glm::vec3> extent; // half size on each axis (cylinder: radius, radius, half height)
+	std::vector<uint8_t> flags;
+	uint steps = 0;
+
+	uint size() const { return position.size(); }
+
+	uint add(glm::vec3 pos, glm::vec3 vel, float radius, float half_height, uint8_t flags = 0);
+	uint add_cuboid(glm::vec3 pos, glm::vec3 vel, glm::vec3 half_size, uint8_t flags = 0);
+	// Last body takes place of removed one
+	void remove(uint index);
+	void clear();
+	void step(float dt, GatherSolid gather);
+	// Wakes up bodies with center in box <lo>..<hi>
+	void wake(glm::vec3 lo, glm::vec3 hi);
+};
@@ -28,6 +28,106 @@ int gen_buffer(GLenum target, GLsizei size, const void* data)
 	return buffer;
 }
 
+// Render::BufferArena
+
+BufferArena::BufferArena(GLenum target, uint32_t element_size, uint32_t capacity)
+	: m_target(target), m_buffer(0), m_element_size(element_size), m_capacity(0), m_used(0), m_upload_bytes(0)
+{
+	grow(capacity);
+}
+
+BufferArena::~BufferArena()
+{
+	glDeleteBuffers(1, &m_buffer);
+}
+
+uint32_t BufferArena::alloc(uint32_t count)
+{
+	assert(count > 0);
+	while (true)
+	{
+		// first fit
+		FOR(i, m_free.size())
+		{
+			Range& r = m_free[i];
+			if (r.count < count) continue;
+			uint32_t offset = r.offset;
+			r.offset += count;
+			r.count -= count;
+			if (r.count == 0) m_free.erase(m_free.begin() + i);
+			m_used += count;
+			return offset;
+		}
+		grow(std::max(m_capacity * 2, m_capacity + count));
+	}
+}
+
+void BufferArena::release(uint32_t offset, uint32_t count)
+{
+	if (count == 0) return;
+	assert(offset + count <= m_capacity);
+	m_used -= count;
+
+	auto it = std::lower_bound(m_free.begin(), m_free.end(), offset, [](const Range& r, uint32_t offset) { return r.offset < offset; });
+	assert(it == m_free.end() || offset + count <= it->offset);
+	bool merge_prev = it != m_free.begin() && (it - 1)->offset + (it - 1)->count == offset;
+	bool merge_next = it != m_free.end() && offset + count == it->offset;
+
+	if (merge_prev && merge_next)
+	{
+		(it - 1)->count += count + it->count;
+		m_free.erase(it);
+	}
+	else if (merge_prev)
+	{
+		(it - 1)->count += count;
+	}
+	else if (merge_next)
+	{
+		it->offset = offset;
+		it->count += count;
+	}
+	else
+	{
+		m_free.insert(it, Range{ offset, count });
+	}
+}
+
+void BufferArena::upload(uint32_t offset, uint32_t count, const void* data)
+{
+	if (count == 0) return;
+	assert(offset + count <= m_capacity);
+	glBindBuffer(m_target, m_buffer);
+	glBufferSubData(m_target, (GLintptr)offset * m_element_size, (GLsizeiptr)count * m_element_size, data);
+	m_upload_bytes += count * m_element_size;
+}
+
+void BufferArena::grow(uint32_t capacity)
+{
+	assert(capacity > m_capacity);
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)capacity * m_element_size, nullptr, GL_DYNAMIC_DRAW);
+	if (m_buffer)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)m_capacity * m_element_size);
+		glDeleteBuffers(1, &m_buffer);
+	}
+
+	if (!m_free.empty() && m_free.back().offset + m_free.back().count == m_capacity)
+	{
+		m_free.back().count += capacity - m_capacity;
+	}
+	else
+	{
+		m_free.push_back(Range{ m_capacity, capacity - m_capacity });
+	}
+	m_buffer = buffer;
+	m_capacity = capacity;
+}
+
 // Render::Texture
 
 #define LODEPNG_COMPILE_CPP
@@ -86,12 +186,18 @@ GLuint make_shader(GLenum type, std::string source)
 	return shader;
 }
 
-GLuint load_shader(GLenum type, const char* name, const char* ext)
+GLuint load_shader(GLenum type, const char* name, const char* ext, const char* header)
 {
 	char* filename;
 	asprintf(&filename, "shaders/%s.%s", name, ext);
 	Auto(free(filename));
-	return make_shader(type, read_file(filename));
+	std::string source = read_file(filename);
+	if (header)
+	{
+		release_assertf(source.compare(0, 8, "#version") == 0, "%s must start with #version", filename);
+		source = header + source.substr(source.find('\n') + 1);
+	}
+	return make_shader(type, source);
 }
 
 GLuint make_program(const ivector<GLuint, 3>& shaders)
@@ -116,12 +222,12 @@ GLuint make_program(const ivector<GLuint, 3>& shaders)
 	return program;
 }
 
-GLuint load_program(const char* name, bool geometry)
+GLuint load_program(const char* name, bool geometry, const char* header)
 {
 	ivector<GLuint, 3> shaders;
-	shaders.push_back(load_shader(GL_VERTEX_SHADER, name, "vert"));
-	if (geometry) shaders.push_back(load_shader(GL_GEOMETRY_SHADER, name, "geom"));
-	shaders.push_back(load_shader(GL_FRAGMENT_SHADER, name, "frag"));
+	shaders.push_back(load_shader(GL_VERTEX_SHADER, name, "vert", header));
+	if (geometry) shaders.push_back(load_shader(GL_GEOMETRY_SHADER, name, "geom", header));
+	shaders.push_back(load_shader(GL_FRAGMENT_SHADER, name, "frag", header));
 	return make_program(shaders);
 }
 
@@ -136,16 +242,16 @@ static GLuint text_uv_loc;
 static GLuint text_fg_color_loc;
 static GLuint text_bg_color_loc;
 
-void make_character(float* vertex, float* texture, float x, float y, float n, float m, char c)
+void make_character(glm::vec2* vertex, glm::vec2* texture, float x, float y, float n, float m, char c)
 {
-	float* v = vertex;
-	*v++ = x - n; *v++ = y - m;
-	*v++ = x + n; *v++ = y - m;
-	*v++ = x + n; *v++ = y + m;
+	glm::vec2* v = vertex;
+	*v++ = glm::vec2(x - n, y - m);
+	*v++ = glm::vec2(x + n, y - m);
+	*v++ = glm::vec2(x + n, y + m);
 
-	*v++ = x - n; *v++ = y - m;
-	*v++ = x + n; *v++ = y + m;
-	*v++ = x - n; *v++ = y + m;
+	*v++ = glm::vec2(x - n, y - m);
+	*v++ = glm::vec2(x + n, y + m);
+	*v++ = glm::vec2(x - n, y + m);
 
 	float a = 0.0625;
 	float b = a * 2;
@@ -153,53 +259,15 @@ void make_character(float* vertex, float* texture, float x, float y, float n, fl
 	float du = (w % 16) * a;
 	float dv = 1 - (w / 16) * b - b;
 	float p = 0;
-	float* t = texture;
-
-	*t++ = du + 0; *t++ = dv + p;
-	*t++ = du + a; *t++ = dv + p;
-	*t++ = du + a; *t++ = dv + b - p;
-
-	*t++ = du + 0; *t++ = dv + p;
-	*t++ = du + a; *t++ = dv + b - p;
-	*t++ = du + 0; *t++ = dv + b - p;
-}
-
-void text_gen_buffers(GLuint position_buffer, GLuint uv_buffer, float x, float y, float n, const char* text, std::vector<GLfloat>& position_data, std::vector<GLfloat>& uv_data)
-{
-	int length = strlen(text);
-	position_data.resize(length * 6 * 2);
-	uv_data.resize(length * 6 * 2);
-
-	for (int i = 0; i < length; i++)
-	{
-		make_character(&position_data[0] + i * 12, &uv_data[0] + i * 12, x, y, n / 2, n, text[i]);
-		x += n;
-	}
+	glm::vec2* t = texture;
 
-	glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * length * 6 * 2, &position_data[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, uv_buffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * length * 6 * 2, &uv_data[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-}
+	*t++ = glm::vec2(du + 0, dv + p);
+	*t++ = glm::vec2(du + a, dv + p);
+	*t++ = glm::vec2(du + a, dv + b - p);
 
-void text_draw_buffers(GLuint position_buffer, GLuint uv_buffer, GLuint position_loc, GLuint uv_loc, int length)
-{
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glEnableVertexAttribArray(text_position_loc);
-	glEnableVertexAttribArray(text_uv_loc);
-
-	glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
-	glVertexAttribPointer(position_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, uv_buffer);
-	glVertexAttribPointer(uv_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glDrawArrays(GL_TRIANGLES, 0, length * 6);
-
-	glDisableVertexAttribArray(position_loc);
-	glDisableVertexAttribArray(uv_loc);
-	glDisable(GL_BLEND);
+	*t++ = glm::vec2(du + 0, dv + p);
+	*t++ = glm::vec2(du + a, dv + b - p);
+	*t++ = glm::vec2(du + 0, dv + b - p);
 }
 
 Text::Text()
@@ -207,14 +275,25 @@ Text::Text()
 	text_program = load_program("text");
 	text_matrix_loc = glGetUniformLocation(text_program, "matrix");
 	text_sampler_loc = glGetUniformLocation(text_program, "sampler");
-	text_fg_color_loc = glGetUniformLocation(text_program, "fg_color");
-	text_bg_color_loc = glGetUniformLocation(text_program, "bg_color");
 	text_position_loc = glGetAttribLocation(text_program, "position");
 	text_uv_loc = glGetAttribLocation(text_program, "uv");
+	text_fg_color_loc = glGetAttribLocation(text_program, "fg_color");
+	text_bg_color_loc = glGetAttribLocation(text_program, "bg_color");
 	glBindFragDataLocation(text_program, 0, "color");
 
-	glGenBuffers(1, &m_positionBuffer);
-	glGenBuffers(1, &m_uvBuffer);
+	m_buffer = 0;
+	m_capacity = 0;
+	m_persistent = false;
+	m_mapped = nullptr;
+	m_region = 0;
+	FOR(i, TextRegions) m_fences[i] = 0;
+#ifdef GL_VERSION_4_4
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	m_persistent = major > 4 || (major == 4 && minor >= 4);
+#endif
+	Reserve(6 * ConsoleWidth * (ConsoleHeight + 10));
 
 	glGenTextures(1, &text_texture);
 	glBindTexture(GL_TEXTURE_2D, text_texture);
@@ -223,14 +302,41 @@ Text::Text()
 	load_png_texture("font.png");
 }
 
+void Text::Reserve(uint32_t count)
+{
+	if (count <= m_capacity && m_buffer != 0) return;
+	m_capacity = std::max(count, m_capacity * 2);
+	m_vertices.reserve(m_capacity);
+	if (!m_persistent)
+	{
+		if (m_buffer == 0) glGenBuffers(1, &m_buffer);
+		return;
+	}
+#ifdef GL_VERSION_4_4
+	// Immutable storage can't be resized, so replace the buffer
+	FOR(i, TextRegions) if (m_fences[i])
+	{
+		glClientWaitSync(m_fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		glDeleteSync(m_fences[i]);
+		m_fences[i] = 0;
+	}
+	if (m_buffer != 0) glDeleteBuffers(1, &m_buffer);
+	glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+	GLsizeiptr size = sizeof(Vertex) * m_capacity * TextRegions;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+	m_mapped = (Vertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+}
+
 void Text::Reset(int width, int height, glm::mat4& matrix, bool down)
 {
+	if (matrix != m_matrix) Flush();
+	m_matrix = matrix;
 	fg_color = glm::vec4(1, 1, 1, 1);
 	bg_color = glm::vec4(0, 0, 0, 0.4);
-	glBindTexture(GL_TEXTURE_2D, text_texture);
-	glUseProgram(text_program);
-	glUniformMatrix4fv(text_matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
-	glUniform1i(text_sampler_loc, 0/*text_texture*/);
 	int lines = (height > width) ? 80 : 40;
 	m_ts = height / (lines * 2);
 	m_tx = m_ts / 2;
@@ -246,7 +352,7 @@ void Text::Print(const char* format, ...)
 	int length = vsnprintf(buffer, sizeof(buffer), format, va);
 	va_end(va);
 
-	PrintBuffer(buffer, length);
+	PrintBuffer(buffer, std::min<int>(length, sizeof(buffer) - 1));
 }
 
 void Text::PrintBuffer(const char* buffer, int length)
@@ -257,10 +363,77 @@ void Text::PrintBuffer(const char* buffer, int length)
 
 void Text::PrintAt(float x, float y, float n, const char* text, int length)
 {
-	text_gen_buffers(m_positionBuffer, m_uvBuffer, x, y, (n == 0) ? m_ts : n, text, m_position_data, m_uv_data);
-	glUniform4fv(text_fg_color_loc, 1, glm::value_ptr(fg_color));
-	glUniform4fv(text_bg_color_loc, 1, glm::value_ptr(bg_color));
-	text_draw_buffers(m_positionBuffer, m_uvBuffer, text_position_loc, text_uv_loc, length);
+	if (n == 0) n = m_ts;
+	glm::u8vec4 fg(glm::round(glm::clamp(fg_color, 0.0f, 1.0f) * 255.0f));
+	glm::u8vec4 bg(glm::round(glm::clamp(bg_color, 0.0f, 1.0f) * 255.0f));
+
+	uint32_t first = m_vertices.size();
+	m_vertices.resize(first + length * 6);
+	Vertex* v = &m_vertices[first];
+	FOR(i, length)
+	{
+		glm::vec2 position[6], uv[6];
+		make_character(position, uv, x, y, n / 2, n, text[i]);
+		FOR(j, 6) *v++ = { position[j], uv[j], fg, bg };
+		x += n;
+	}
+}
+
+void Text::Flush()
+{
+	uint32_t count = m_vertices.size();
+	if (count == 0) return;
+
+	Reserve(count);
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+	uint32_t first = 0;
+	if (m_persistent)
+	{
+		m_region = (m_region + 1) % TextRegions;
+		if (m_fences[m_region])
+		{
+			glClientWaitSync(m_fences[m_region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			glDeleteSync(m_fences[m_region]);
+			m_fences[m_region] = 0;
+		}
+		first = m_region * m_capacity;
+		std::copy(m_vertices.begin(), m_vertices.end(), m_mapped + first);
+	}
+	else
+	{
+		// Orphan storage still used by previous draw
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * m_capacity, nullptr, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vertex) * count, m_vertices.data());
+	}
+
+	glBindTexture(GL_TEXTURE_2D, text_texture);
+	glUseProgram(text_program);
+	glUniformMatrix4fv(text_matrix_loc, 1, GL_FALSE, glm::value_ptr(m_matrix));
+	glUniform1i(text_sampler_loc, 0/*text_texture*/);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glEnableVertexAttribArray(text_position_loc);
+	glEnableVertexAttribArray(text_uv_loc);
+	glEnableVertexAttribArray(text_fg_color_loc);
+	glEnableVertexAttribArray(text_bg_color_loc);
+
+	Vertex* m = nullptr;
+	glVertexAttribPointer(text_position_loc, 2, GL_FLOAT, GL_FALSE, sizeof(*m), &m->position);
+	glVertexAttribPointer(text_uv_loc, 2, GL_FLOAT, GL_FALSE, sizeof(*m), &m->uv);
+	glVertexAttribPointer(text_fg_color_loc, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(*m), &m->fg_color);
+	glVertexAttribPointer(text_bg_color_loc, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(*m), &m->bg_color);
+	glDrawArrays(GL_TRIANGLES, first, count);
+	if (m_persistent) m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	glDisableVertexAttribArray(text_position_loc);
+	glDisableVertexAttribArray(text_uv_loc);
+	glDisableVertexAttribArray(text_fg_color_loc);
+	glDisableVertexAttribArray(text_bg_color_loc);
+	glDisable(GL_BLEND);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+	m_vertices.clear();
 }
 
 Console::Console()
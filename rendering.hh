@@ -19,9 +19,53 @@
 void Error(const char* name);
 
 int gen_buffer(GLenum target, GLsizei size, const void* data);
-GLuint load_program(const char* name, bool geometry = false);
+
+// One large GPU buffer suballocated in units of <element_size> bytes.
+// Offsets and counts are in elements, so they can be passed directly as <first> to glDrawArrays.
+class BufferArena
+{
+public:
+	BufferArena(GLenum target, uint32_t element_size, uint32_t capacity);
+	~BufferArena();
+
+	// Returns offset of <count> contiguous elements. Grows the buffer if needed.
+	uint32_t alloc(uint32_t count);
+	void release(uint32_t offset, uint32_t count);
+	void upload(uint32_t offset, uint32_t count, const void* data);
+
+	GLuint buffer() const { return m_buffer; }
+	uint32_t capacity() const { return m_capacity; }
+	uint32_t used() const { return m_used; }
+
+	// Bytes sent with upload() since last call
+	uint32_t take_upload_bytes() { uint32_t a = m_upload_bytes; m_upload_bytes = 0; return a; }
+
+private:
+	void grow(uint32_t capacity);
+
+private:
+	GLenum m_target;
+	GLuint m_buffer;
+	uint32_t m_element_size;
+	uint32_t m_capacity;
+	uint32_t m_used;
+	uint32_t m_upload_bytes;
+
+	struct Range
+	{
+		uint32_t offset, count;
+	};
+	std::vector<Range> m_free; // sorted by offset, never adjacent
+};
+std::string read_file(const char* filename);
+// <header>, if given, replaces the #version line of every shader (to select GLSL version and add #defines)
+GLuint load_program(const char* name, bool geometry = false, const char* header = nullptr);
 void load_png_texture(std::string filename);
 
+// Regions of persistent mapped text vertex buffer (frames the GPU can lag behind)
+const int TextRegions = 3;
+
+// Glyphs printed during a frame are accumulated and drawn with a single Flush().
 class Text
 {
 public:
@@ -30,20 +74,38 @@ public:
 	void Print(const char* fmt, ...) __printflike(2, 3);
 	void PrintBuffer(const char* buffer, int length);
 	void PrintAt(float x, float y, float n, const char* text, int length);
+	void Flush();
 
 	glm::vec4 fg_color;
 	glm::vec4 bg_color;
 
+private:
+	void Reserve(uint32_t count);
+
 private:
 	float m_tx;
 	float m_ty;
 	float m_ts;
 	float m_tdy;
 
-	GLuint m_positionBuffer;
-	GLuint m_uvBuffer;
-	std::vector<GLfloat> m_position_data;
-	std::vector<GLfloat> m_uv_data;
+	struct Vertex
+	{
+		glm::vec2 position;
+		glm::vec2 uv;
+		glm::u8vec4 fg_color;
+		glm::u8vec4 bg_color;
+	};
+
+	glm::mat4 m_matrix;
+	std::vector<Vertex> m_vertices;
+
+	GLuint m_buffer;
+	uint32_t m_capacity; // in vertices, per region
+	// With persistent mapping buffer is split into regions written in turn, each guarded by fence until GPU is done with it
+	bool m_persistent;
+	Vertex* m_mapped;
+	uint32_t m_region;
+	GLsync m_fences[TextRegions];
 };
 
 // TODO make it work for vertical monitor setup
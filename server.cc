@@ -6,8 +6,11 @@
 #include "maplock.hh"
 #include "auto.hh"
 #include "lz4.h"
+#include "physics.hh"
 
 #include <unordered_map>
+#include <deque>
+#include <chrono>
 
 void generate_chunk(Blocks& chunk, glm::ivec3 cpos);
 
@@ -17,12 +20,52 @@ Sphere g_server_render_sphere(40/*RenderDistance*/);
 
 struct ServerAvatar
 {
-	bool broadcasted;
+	bool spawned; // first MessagePlayerSpawn received
 	uint8_t id;
 	glm::vec3 position;
 	float yaw, pitch;
+
+	// Authoritative player state, advanced by client inputs
+	PlayerState state;
+	uint32_t next_seq; // seq of next expected input step
+	uint8_t spawn_id;
+	bool ack; // state changed since last MessagePlayerAck
+	double input_credit; // input steps client can still run ahead of server clock
+	Timestamp input_time; // when input_credit was last refilled
+	uint seq_errors;
+	uint8_t modes; // PlayerInput mode flags player may use
+	bool modes_denied; // player was told that it used other modes
+};
+
+// Undo history of one player. Each edit batch or import is one Transaction of chunk diffs: runs of changed blocks with
+// their literal values before and after (see encode_diff), so the same diff both undoes and redoes it. Diffs are not
+// XOR of before and after as first planned: undo needs the after values to tell which blocks were changed since by
+// someone else, and keeps those (see apply_diff). When over memory limit oldest transactions are moved to a temporary
+// file.
+struct Journal
+{
+	struct Transaction
+	{
+		std::vector<uint8_t> data; // records: int32_t cpos[3], uint16_t size, <size> bytes of encode_diff()
+		uint size;
+		long offset; // in spill file, -1 if not written there yet
+	};
+
+	std::deque<Transaction> undo;
+	std::deque<Transaction> redo;
+	uint memory = 0; // bytes of transaction data in memory
+	FILE* spill = nullptr;
+	long spill_size = 0;
+
+	~Journal() { if (spill) fclose(spill); }
+	void push(Transaction&& t);
+	bool load(Transaction& t);
+	void trim();
+	void compact();
 };
 
+struct EditJob;
+
 struct Connection
 {
 	Socket sock;
@@ -35,11 +78,33 @@ struct Connection
 	XCube<MapSize, glm::ivec3> m_chunks;
 	int m_scaned_chunks;
 
+	// Avatar states as last sent to this client, indexed by avatar id
+	struct Replica
+	{
+		bool visible;
+		uint32_t tick;
+		glm::ivec3 position; // absolute, in 1/AvatarPositionScale of block
+		uint16_t orientation;
+	};
+	Replica m_replicas[256];
+	std::vector<uint8_t> m_removed; // avatars to be removed on client
+
+	std::vector<glm::vec3> m_import; // mesh triangles uploaded so far, 3 vertices each
+	uint m_import_skipped; // triangles dropped from upload: invalid, too large or over MaxImportVertices
+
+	std::vector<Block> m_clipboard; // RegionOp::Copy, x fastest
+	glm::ivec3 m_clipboard_size;
+
+	Journal m_journal;
+	std::deque<EditJob*> m_edit_jobs;
+
 	Connection()
 	{
 		m_cpos = x_bad_ivec3;
 		m_scaned_chunks = g_server_render_sphere.size();
 		m_chunks.clear(x_bad_ivec3);
+		m_import_skipped = 0;
+		FOR(i, 256) m_replicas[i].visible = false;
 	}
 
 	void update_cpos()
@@ -657,6 +722,90 @@ void server_simulate_blocks()
 
 // =============
 
+Bodies g_bodies;
+
+// Cubes in chunks that are not loaded are solid, so that bodies don't fall through them
+bool server_is_solid(glm::ivec3 cube)
+{
+	Chunk chunk = g_scm.get(cube >> ChunkSizeBits);
+	if (chunk.sc == nullptr) return true;
+	return !can_move_through(chunk[cube & ChunkSizeMask]);
+}
+
+bool server_is_water(glm::ivec3 cube)
+{
+	return get_block(cube, Block::none) == Block::water;
+}
+
+// Same as SolidityMask::gather(c, server_is_solid), but looks up each chunk once and reads its blocks directly
+void server_gather_solid(SolidityMask& mask, glm::ivec3 c)
+{
+	mask.center = c;
+	glm::ivec3 lo = c - 2, hi = c + 2;
+	memset(mask.rows, 0, sizeof(mask.rows));
+	glm::ivec3 clo = lo >> ChunkSizeBits, chi = hi >> ChunkSizeBits;
+	FOR2(cx, clo.x, chi.x) FOR2(cy, clo.y, chi.y) FOR2(cz, clo.z, chi.z)
+	{
+		glm::ivec3 cpos(cx, cy, cz);
+		Chunk chunk = g_scm.get(cpos);
+		const Blocks* blocks = chunk.sc ? &chunk.blocks() : nullptr;
+		glm::ivec3 a = glm::max(lo, cpos << ChunkSizeBits);
+		glm::ivec3 b = glm::min(hi, (cpos << ChunkSizeBits) + ChunkSizeMask);
+		FOR2(z, a.z, b.z) FOR2(y, a.y, b.y)
+		{
+			uint8_t row = 0;
+			FOR2(x, a.x, b.x) if (!blocks || !can_move_through((*blocks)[glm::ivec3(x, y, z) & ChunkSizeMask])) row |= 1 << (x - lo.x);
+			mask.rows[z - lo.z][y - lo.y] |= row;
+		}
+	}
+}
+
+void server_simulate_bodies()
+{
+	if (g_bodies.size() == 0) return;
+	g_bodies.step(PhysicsDt, server_gather_solid);
+}
+
+// Drops <count> bodies (half cylinders, half cuboids) onto terrain around origin and times Bodies::step() without any networking
+void physics_benchmark(int count)
+{
+	const int Region = 2; // in chunks, around origin
+	const int Height = 8; // in chunks, starting from z = 0
+	FOR2(x, -Region, Region - 1) FOR2(y, -Region, Region - 1) FOR(z, Height) g_scm.acquire_chunk(glm::ivec3(x, y, z), true);
+
+	srand(1);
+	FOR(i, count)
+	{
+		glm::ivec3 column(rand() % (Region * 2 * ChunkSize) - Region * ChunkSize, rand() % (Region * 2 * ChunkSize) - Region * ChunkSize, 0);
+		int ground = 0;
+		for (int z = Height * ChunkSize - 1; z >= 0; z--)
+		{
+			if (server_is_solid(glm::ivec3(column.x, column.y, z))) { ground = z + 1; break; }
+		}
+		glm::vec3 pos(column.x + 0.5f, column.y + 0.5f, ground + 1 + rand() % 20);
+		glm::vec3 vel((rand() % 200 - 100) * 0.02f, (rand() % 200 - 100) * 0.02f, 0);
+		if (i % 2 == 0)
+		{
+			g_bodies.add(pos, vel, 0.48f, 0.96f);
+		}
+		else
+		{
+			g_bodies.add_cuboid(pos, vel, glm::vec3(0.45f, 0.45f, 0.45f));
+		}
+	}
+
+	const int Steps = 1000;
+	auto start = std::chrono::steady_clock::now();
+	FOR(i, Steps) server_simulate_bodies();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	int on_ground = 0;
+	FOR(i, g_bodies.size()) if (g_bodies.flags[i] & Bodies::OnGround) on_ground += 1;
+	fprintf(stderr, "%d bodies, %d steps: %.3f ms per step, %.1f ns per body step, %d bodies on ground\n", count, Steps, ms / Steps, ms * 1e6 / Steps / std::max(1, count), on_ground);
+}
+
+// =============
+
 static std::vector<uint8_t> g_free_ids;
 
 uint8_t create_id()
@@ -671,23 +820,783 @@ void destroy_id(uint8_t id)
 	g_free_ids.push_back(id);
 }
 
+// =============
+
+const uint JournalMemory = 16 << 20; // per player
+const uint MaxJournalTransactions = 1000;
+
+void Journal::push(Transaction&& t)
+{
+	t.size = t.data.size();
+	t.offset = -1;
+	memory += t.size;
+	undo.push_back(std::move(t));
+	for (Transaction& r : redo) memory -= r.data.size();
+	redo.clear();
+	trim();
+}
+
+// Reads transaction back from spill file if needed
+bool Journal::load(Transaction& t)
+{
+	if (t.data.size() == t.size) return true;
+	t.data.resize(t.size);
+	if (fseek(spill, t.offset, SEEK_SET) != 0 || fread(t.data.data(), 1, t.size, spill) != t.size)
+	{
+		release(t.data);
+		return false;
+	}
+	memory += t.size;
+	return true;
+}
+
+void Journal::trim()
+{
+	while (undo.size() > MaxJournalTransactions)
+	{
+		memory -= undo.front().data.size();
+		undo.pop_front();
+	}
+	compact();
+	for (std::deque<Transaction>* stack : { &undo, &redo }) for (Transaction& t : *stack)
+	{
+		if (memory <= JournalMemory) return;
+		if (t.data.size() == 0) continue;
+		if (t.offset < 0)
+		{
+			// Data never changes, so transaction loaded back from file doesn't need to be written again
+			if (!spill) spill = tmpfile();
+			if (!spill || fseek(spill, 0, SEEK_END) != 0) return;
+			t.offset = ftell(spill);
+			if (fwrite(t.data.data(), 1, t.size, spill) != t.size)
+			{
+				t.offset = -1;
+				return;
+			}
+			spill_size = t.offset + t.size;
+		}
+		memory -= t.size;
+		release(t.data);
+	}
+}
+
+// Rewrites spill file once most of it belongs to dropped transactions
+void Journal::compact()
+{
+	long live = 0;
+	for (std::deque<Transaction>* stack : { &undo, &redo }) for (Transaction& t : *stack) if (t.offset >= 0) live += t.size;
+	if (!spill || spill_size <= live * 2 + JournalMemory) return;
+
+	FILE* file = tmpfile();
+	if (!file) return;
+	std::vector<long> offsets;
+	std::vector<uint8_t> buffer;
+	long size = 0;
+	for (std::deque<Transaction>* stack : { &undo, &redo }) for (Transaction& t : *stack)
+	{
+		if (t.offset < 0) continue;
+		buffer.resize(t.size);
+		if (fseek(spill, t.offset, SEEK_SET) != 0 || fread(buffer.data(), 1, t.size, spill) != t.size || fwrite(buffer.data(), 1, t.size, file) != t.size)
+		{
+			fclose(file);
+			return;
+		}
+		offsets.push_back(size);
+		size += t.size;
+	}
+
+	uint i = 0;
+	for (std::deque<Transaction>* stack : { &undo, &redo }) for (Transaction& t : *stack) if (t.offset >= 0) t.offset = offsets[i++];
+	fclose(spill);
+	spill = file;
+	spill_size = size;
+}
+
+// Appends record of changed blocks of chunk: runs of (uint16_t skip, uint16_t count, <count> blocks before, <count> blocks after).
+// Appends nothing if no block changed.
+void encode_diff(glm::ivec3 cpos, const uint8_t* before, const uint8_t* after, std::vector<uint8_t>& out)
+{
+	const uint header = sizeof(glm::ivec3) + sizeof(uint16_t);
+	uint start = out.size();
+	out.resize(start + header);
+	int i = 0, last = 0;
+	while (true)
+	{
+		while (i < ChunkSize3 && before[i] == after[i]) i += 1;
+		if (i == ChunkSize3) break;
+		// literal run ends at 4 unchanged blocks
+		int j = i, same = 0;
+		while (j < ChunkSize3 && same < 4)
+		{
+			same = (before[j] == after[j]) ? same + 1 : 0;
+			j += 1;
+		}
+		j -= same;
+		uint16_t run[2] = { uint16_t(i - last), uint16_t(j - i) };
+		out.insert(out.end(), (const uint8_t*)run, (const uint8_t*)(run + 2));
+		out.insert(out.end(), before + i, before + j);
+		out.insert(out.end(), after + i, after + j);
+		i = last = j;
+	}
+	if (out.size() == start + header)
+	{
+		out.resize(start);
+		return;
+	}
+	uint16_t size = out.size() - start - header;
+	memcpy(&out[start], &cpos, sizeof(cpos));
+	memcpy(&out[start + sizeof(cpos)], &size, sizeof(size));
+}
+
+// Reads record header at <offset>, returns offset of next record
+uint decode_diff_header(const std::vector<uint8_t>& data, uint offset, glm::ivec3& cpos, uint16_t& size)
+{
+	int32_t c[3];
+	memcpy(c, &data[offset], sizeof(c));
+	memcpy(&size, &data[offset + sizeof(c)], sizeof(size));
+	cpos = glm::ivec3(c[0], c[1], c[2]);
+	return offset + sizeof(c) + sizeof(size) + size;
+}
+
+// Undo sets blocks back to before (redo to after), but only blocks which are still as the edit left them (or found them).
+// Blocks changed since by someone else (other players, block simulation) are kept. Returns number of those.
+uint apply_diff(const uint8_t* diff, uint size, Block* blocks, bool redo)
+{
+	uint8_t* b = reinterpret_cast<uint8_t*>(blocks);
+	const uint8_t* end = diff + size;
+	int pos = 0;
+	uint conflicts = 0;
+	while (diff < end)
+	{
+		uint16_t run[2];
+		memcpy(run, diff, sizeof(run));
+		diff += sizeof(run);
+		pos += run[0];
+		const uint8_t* from = redo ? diff : diff + run[1];
+		const uint8_t* to = redo ? diff + run[1] : diff;
+		FOR(k, run[1])
+		{
+			if (b[pos] == from[k])
+			{
+				b[pos] = to[k];
+			}
+			else if (b[pos] != to[k])
+			{
+				conflicts += 1;
+			}
+			pos += 1;
+		}
+		diff += run[1] * 2;
+	}
+	return conflicts;
+}
+
+const uint MaxRecordedChunks = 64;
+
+// Chunks touched by an edit in progress, with their blocks before the edit.
+// Once MaxRecordedChunks are held they are encoded into transaction (and a chunk touched again later gets another record).
+struct EditRecorder
+{
+	std::vector<glm::ivec3> chunks;
+	std::vector<Block> before; // ChunkSize3 blocks per chunk
+	Journal::Transaction transaction;
+
+	void touch(glm::ivec3 cpos, Chunk& chunk)
+	{
+		if (chunks.size() > 0 && chunks.back() == cpos) return;
+		if (contains(chunks, cpos)) return;
+		if (chunks.size() == MaxRecordedChunks) flush();
+		chunks.push_back(cpos);
+		const Block* blocks = reinterpret_cast<const Block*>(&chunk.blocks());
+		before.insert(before.end(), blocks, blocks + ChunkSize3);
+	}
+
+	void flush()
+	{
+		FOR(i, chunks.size())
+		{
+			const uint8_t* a = reinterpret_cast<const uint8_t*>(&before[i * ChunkSize3]);
+			const uint8_t* b = reinterpret_cast<const uint8_t*>(&g_scm.get(chunks[i]).blocks());
+			encode_diff(chunks[i], a, b, transaction.data);
+		}
+		chunks.clear();
+		before.clear();
+	}
+
+	void commit(Journal& journal)
+	{
+		flush();
+		if (transaction.data.size() > 0) journal.push(std::move(transaction));
+		transaction = Journal::Transaction();
+	}
+};
+
+static EditRecorder* g_recorder = nullptr; // records edits of player's message being processed
+
+// Chunks changed by edits since last server_notify_edits(). Each is sent to clients only once, however many blocks changed.
+static std::vector<glm::ivec3> g_edited_chunks;
+
+Chunk server_acquire_chunk(glm::ivec3 cpos)
+{
+	g_scm.acquire_chunk(cpos, true); // TODO: release?
+	return g_scm.get(cpos);
+}
+
+// Returns true if block changed
+bool server_set_block(Chunk& chunk, glm::ivec3 pos, Block block)
+{
+	if (chunk[pos & ChunkSizeMask] == block) return false;
+	if (g_recorder) g_recorder->touch(pos >> ChunkSizeBits, chunk);
+	chunk.set(pos & ChunkSizeMask, block);
+	return true;
+}
+
 void server_edit_block(glm::ivec3 pos, Block block)
 {
 	glm::ivec3 cpos = pos >> ChunkSizeBits;
-	Blocks& chunk = *g_scm.acquire_chunk(cpos, true); // TODO: release?
-	chunk[pos & ChunkSizeMask] = block;
+	Chunk chunk = server_acquire_chunk(cpos);
+	if (server_set_block(chunk, pos, block)) g_edited_chunks.push_back(cpos);
+}
+
+// Calls <func>(chunk, cube) for every cube of box <lo>..<hi> inside chunk <cpos>. <func> returns true if it changed the cube.
+template<typename Func>
+void server_edit_box(glm::ivec3 lo, glm::ivec3 hi, glm::ivec3 cpos, const Func& func)
+{
+	Chunk chunk = server_acquire_chunk(cpos);
+	glm::ivec3 a = glm::max(lo, cpos << ChunkSizeBits);
+	glm::ivec3 b = glm::min(hi, (cpos << ChunkSizeBits) + ChunkSizeMask);
+	bool changed = false;
+	FOR2(x, a.x, b.x) FOR2(y, a.y, b.y) FOR2(z, a.z, b.z)
+	{
+		if (func(chunk, glm::ivec3(x, y, z))) changed = true;
+	}
+	if (changed) g_edited_chunks.push_back(cpos);
+}
+
+// Edit batches, mesh imports and undos of player are applied in order they arrived, EditChunksPerTick chunks per player
+// per tick. Each batch and import is one undo step.
+const int MaxEditDistance = 40/*RenderDistance*/; // in chunks, edited blocks must be this close to player
+const int MaxRegionExtent = 256; // in blocks, on each axis
+const uint MaxBatchChunks = 1 << 14; // all regions of batch together
+const uint MaxEditJobs = 8; // pending jobs per player
+const uint EditChunksPerTick = 64;
+
+struct ImportJob;
+
+struct EditJob
+{
+	std::vector<BlockEdit> edits; // applied first, all at once
+	std::vector<RegionEdit> regions;
+	uint region; // in progress
+	glm::ivec3 lo, hi; // box of region in progress
+	int chunk; // next chunk of box, -1 if region isn't started yet
+	uint chunks; // visited by all regions so far
+	EditRecorder recorder;
+	ImportJob* import; // if not null, job is this mesh import instead
+	int undo; // if not -1, job is undo (0) or redo (1) instead
+
+	EditJob() : region(0), chunk(-1), chunks(0), import(nullptr), undo(-1) { }
+};
+
+// Job is applied after all earlier jobs of player, or rejected (and deleted) if there are too many
+bool server_queue_edit_job(Connection& conn, EditJob* job)
+{
+	if (conn.m_edit_jobs.size() >= MaxEditJobs)
+	{
+		write_text_message(conn.send_buffer, "rejected: %u edits still in progress", (uint)conn.m_edit_jobs.size());
+		delete job;
+		return false;
+	}
+	conn.m_edit_jobs.push_back(job);
+	return true;
+}
+
+bool near_player(const Connection& conn, glm::i64vec3 pos)
+{
+	int64_t d2 = 0;
+	FOR(i, 3)
+	{
+		int64_t d = (pos[i] >> ChunkSizeBits) - conn.m_cpos[i];
+		if (std::abs(d) > MaxEditDistance) return false;
+		d2 += d * d;
+	}
+	return d2 <= sqr(MaxEditDistance);
+}
+
+// Box of region (after checking that it is valid, small enough and near player), or error message
+const char* region_box(const Connection& conn, const RegionEdit& edit, glm::ivec3& lo, glm::ivec3& hi)
+{
+	if ((uint)edit.op > (uint)RegionOp::Paste) return "unknown operation";
+	if ((uint)edit.block >= block_count || (uint)edit.match >= block_count) return "invalid block";
+	glm::i64vec3 a(edit.corner_a()), b(edit.corner_b()), l, h;
+	switch (edit.op)
+	{
+	case RegionOp::Sphere:
+		if (b.x < 0 || b.x > (MaxRegionExtent - 1) / 2) return "radius out of range";
+		l = a - b.x;
+		h = a + b.x;
+		break;
+	case RegionOp::Paste:
+		if (conn.m_clipboard.size() == 0) return "clipboard is empty";
+		l = a;
+		h = a + glm::i64vec3(conn.m_clipboard_size) - int64_t(1);
+		break;
+	default:
+		l = glm::min(a, b);
+		h = glm::max(a, b);
+	}
+	FOR(i, 3) if (h[i] - l[i] + 1 > MaxRegionExtent) return "too large";
+	if (!near_player(conn, l) || !near_player(conn, h)) return "too far";
+	lo = glm::ivec3(l);
+	hi = glm::ivec3(h);
+	return nullptr;
+}
+
+// Applies region to the part of its box <lo>..<hi> in chunk <cpos>
+void server_edit_region(Connection& conn, const RegionEdit& edit, glm::ivec3 lo, glm::ivec3 hi, glm::ivec3 cpos)
+{
+	Block block = edit.block, match = edit.match;
+	switch (edit.op)
+	{
+	case RegionOp::Fill:
+		server_edit_box(lo, hi, cpos, [&](Chunk& chunk, glm::ivec3 p) { return server_set_block(chunk, p, block); });
+		return;
+	case RegionOp::Sphere:
+	{
+		glm::ivec3 c = edit.corner_a();
+		int r = edit.b[0];
+		server_edit_box(lo, hi, cpos, [&](Chunk& chunk, glm::ivec3 p) { return glm::distance2(p, c) <= r * r && server_set_block(chunk, p, block); });
+		return;
+	}
+	case RegionOp::Replace:
+		server_edit_box(lo, hi, cpos, [&](Chunk& chunk, glm::ivec3 p) { return chunk[p & ChunkSizeMask] == match && server_set_block(chunk, p, block); });
+		return;
+	case RegionOp::Copy:
+	{
+		glm::ivec3 size = hi - lo + 1;
+		server_edit_box(lo, hi, cpos, [&](Chunk& chunk, glm::ivec3 p)
+		{
+			glm::ivec3 d = p - lo;
+			conn.m_clipboard[(d.z * size.y + d.y) * size.x + d.x] = chunk[p & ChunkSizeMask];
+			return false;
+		});
+		return;
+	}
+	case RegionOp::Paste:
+	{
+		glm::ivec3 size = conn.m_clipboard_size;
+		server_edit_box(lo, hi, cpos, [&](Chunk& chunk, glm::ivec3 p)
+		{
+			glm::ivec3 d = p - lo;
+			return server_set_block(chunk, p, conn.m_clipboard[(d.z * size.y + d.y) * size.x + d.x]);
+		});
+		return;
+	}
+	}
+}
+
+// Returns true when job is done
+bool server_step_edit_job(Connection& conn, EditJob& job, uint& budget)
+{
+	if (job.edits.size() > 0)
+	{
+		uint rejected = 0;
+		for (const BlockEdit& edit : job.edits)
+		{
+			if ((uint)edit.block >= block_count || !near_player(conn, glm::i64vec3(edit.position())))
+			{
+				rejected += 1;
+				continue;
+			}
+			server_edit_block(edit.position(), edit.block);
+		}
+		if (rejected > 0) write_text_message(conn.send_buffer, "%u block edits rejected: invalid block or too far", rejected);
+		release(job.edits);
+	}
+
+	while (job.region < job.regions.size() && budget > 0)
+	{
+		const RegionEdit& edit = job.regions[job.region];
+		if (job.chunk == -1)
+		{
+			const char* error = region_box(conn, edit, job.lo, job.hi);
+			if (error)
+			{
+				write_text_message(conn.send_buffer, "region %u rejected: %s", job.region, error);
+				job.region += 1;
+				continue;
+			}
+			if (edit.op == RegionOp::Copy)
+			{
+				conn.m_clipboard_size = job.hi - job.lo + 1;
+				conn.m_clipboard.assign(conn.m_clipboard_size.x * conn.m_clipboard_size.y * conn.m_clipboard_size.z, Block::none);
+			}
+			job.chunk = 0;
+		}
+
+		glm::ivec3 clo = job.lo >> ChunkSizeBits, chi = job.hi >> ChunkSizeBits;
+		glm::ivec3 n = chi - clo + 1;
+		while (job.chunk < n.x * n.y * n.z && budget > 0)
+		{
+			if (job.chunks == MaxBatchChunks)
+			{
+				write_text_message(conn.send_buffer, "regions from %u rejected: batch touches more than %u chunks", job.region, MaxBatchChunks);
+				job.region = job.regions.size();
+				return true;
+			}
+			int i = job.chunk++;
+			server_edit_region(conn, edit, job.lo, job.hi, clo + glm::ivec3(i % n.x, (i / n.x) % n.y, i / (n.x * n.y)));
+			job.chunks += 1;
+			budget -= 1;
+		}
+		if (job.chunk == n.x * n.y * n.z)
+		{
+			job.region += 1;
+			job.chunk = -1;
+		}
+	}
+	return job.region == job.regions.size();
+}
+
+
+
+// Applies last transaction from undo (or redo) history of player and moves it to the other one
+void server_undo(Connection& conn, bool redo)
+{
+	Journal& journal = conn.m_journal;
+	std::deque<Journal::Transaction>& from = redo ? journal.redo : journal.undo;
+	std::deque<Journal::Transaction>& to = redo ? journal.undo : journal.redo;
+	const char* name = redo ? "redo" : "undo";
+	if (from.size() == 0)
+	{
+		write_text_message(conn.send_buffer, "nothing to %s", name);
+		return;
+	}
+	Journal::Transaction t = std::move(from.back());
+	from.pop_back();
+	if (!journal.load(t))
+	{
+		write_text_message(conn.send_buffer, "%s failed: can't read journal", name);
+		return;
+	}
+
+	// Chunk can have several records (if it was touched again later), so undo goes backwards
+	static std::vector<uint> records;
+	records.clear();
+	for (uint i = 0; i < t.data.size(); )
+	{
+		records.push_back(i);
+		glm::ivec3 cpos;
+		uint16_t size;
+		i = decode_diff_header(t.data, i, cpos, size);
+	}
+	if (!redo) std::reverse(records.begin(), records.end());
+
+	uint conflicts = 0;
+	for (uint offset : records)
+	{
+		glm::ivec3 cpos;
+		uint16_t size;
+		uint end = decode_diff_header(t.data, offset, cpos, size);
+		Chunk chunk = server_acquire_chunk(cpos);
+		conflicts += apply_diff(&t.data[end - size], size, reinterpret_cast<Block*>(&chunk.blocks()), redo);
+		chunk.sc->modified = true;
+		g_edited_chunks.push_back(cpos);
+	}
+	to.push_back(std::move(t));
+	journal.trim();
+	if (conflicts > 0)
+	{
+		write_text_message(conn.send_buffer, "%s: %u chunks, %u blocks changed since were kept", name, (uint)records.size(), conflicts);
+	}
+	else
+	{
+		write_text_message(conn.send_buffer, "%s: %u chunks", name, (uint)records.size());
+	}
+}
+
+// Sends every chunk changed since last call to clients in range, and wakes it up for block simulation
+void server_notify_edits()
+{
+	if (g_edited_chunks.size() == 0) return;
+	std::sort(g_edited_chunks.begin(), g_edited_chunks.end(), less);
+	g_edited_chunks.erase(std::unique(g_edited_chunks.begin(), g_edited_chunks.end()), g_edited_chunks.end());
+	for (glm::ivec3 cpos : g_edited_chunks)
+	{
+		Chunk chunk = g_scm.get(cpos);
+		chunk.activate();
+		// bodies that can touch edited cubes
+		if (g_bodies.size() > 0) g_bodies.wake(glm::vec3(cpos * ChunkSize) - 2.0f, glm::vec3((cpos + 1) * ChunkSize) + 2.0f);
+		for (Connection* conn : g_connections)
+		{
+			// ISSUE: if distance is >40, but still inside Map then client will skip update to chunk
+			// TODO: ensure robust synchnorization of chunks between client and server.
+			//       client can only change its local Map origin (cpos) when it gets ack from server for its position update.
+			if (glm::distance2(conn->m_cpos, cpos) <= sqr(40/*RenderDistance*/))
+			{
+				conn->send_chunk(cpos, chunk.blocks());
+			}
+		}
+	}
+	g_edited_chunks.clear();
+}
+
+// =============
+
+// Mesh import: triangles uploaded by client are voxelized by background threads, and written to map one chunk at a time.
+
+const uint MaxImportVertices = 3 << 22;
+const float MaxTriangleExtent = 32; // in blocks, on each axis
+const float MaxImportExtent = 512; // in blocks, on each axis, import must also be near player
+const int MaxImportThreads = 4;
+
+bool valid_import_triangle(const glm::vec3* v)
+{
+	FOR(i, 3) FOR(j, 3) if (!std::isfinite(v[i][j]) || std::abs(v[i][j]) > 1e9f) return false;
+	glm::vec3 lo = glm::min(v[0], glm::min(v[1], v[2]));
+	glm::vec3 hi = glm::max(v[0], glm::max(v[1], v[2]));
+	FOR(i, 3) if (hi[i] - lo[i] > MaxTriangleExtent) return false;
+	return true;
+}
+
+// Akenine-Moller separating axis test of triangle <a b c> against box centered at origin with half size <h>
+bool triangle_box_overlap(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 h)
+{
+	// box face normals
+	FOR(i, 3)
+	{
+		if (std::min(a[i], std::min(b[i], c[i])) > h[i]) return false;
+		if (std::max(a[i], std::max(b[i], c[i])) < -h[i]) return false;
+	}
+
+	// triangle normal
+	glm::vec3 e[3] = { b - a, c - b, a - c };
+	glm::vec3 n = glm::cross(e[0], e[1]);
+	if (std::abs(glm::dot(n, a)) > glm::dot(h, glm::abs(n))) return false;
+
+	// cross products of box axes and triangle edges
+	FOR(i, 3) FOR(j, 3)
+	{
+		glm::vec3 axis;
+		if (j == 0) axis = glm::vec3(0, -e[i].z, e[i].y);
+		if (j == 1) axis = glm::vec3(e[i].z, 0, -e[i].x);
+		if (j == 2) axis = glm::vec3(-e[i].y, e[i].x, 0);
+		float pa = glm::dot(axis, a), pb = glm::dot(axis, b), pc = glm::dot(axis, c);
+		float r = glm::dot(h, glm::abs(axis));
+		if (std::min(pa, std::min(pb, pc)) > r || std::max(pa, std::max(pb, pc)) < -r) return false;
+	}
+	return true;
+}
+
+// Cubes of import as one bit per cube of its chunk aligned box, chunk after chunk (so each chunk is ChunkWords words)
+const int ChunkWords = ChunkSize * ChunkSize * ChunkSize / 64;
+
+struct ImportCubes
+{
+	glm::ivec3 clo, n; // first chunk and chunks on each axis
+	std::unique_ptr<std::atomic<uint64_t>[]> bits;
+
+	void init(glm::ivec3 lo, glm::ivec3 hi)
+	{
+		clo = lo >> ChunkSizeBits;
+		n = (hi >> ChunkSizeBits) - clo + 1;
+		bits.reset(new std::atomic<uint64_t>[size_t(chunks()) * ChunkWords]());
+	}
+
+	uint chunks() const { return n.x * n.y * n.z; }
+	glm::ivec3 cpos(uint chunk) const { return clo + glm::ivec3(chunk % n.x, (chunk / n.x) % n.y, chunk / (n.x * n.y)); }
+
+	// Safe to call from several threads at once
+	void set(glm::ivec3 cube)
+	{
+		glm::ivec3 c = (cube >> ChunkSizeBits) - clo, p = cube & ChunkSizeMask;
+		uint i = (((c.z * n.y + c.y) * n.x + c.x) << (3 * ChunkSizeBits)) + (((p.z << ChunkSizeBits) + p.y) << ChunkSizeBits) + p.x;
+		bits[i >> 6].fetch_or(uint64_t(1) << (i & 63), std::memory_order_relaxed);
+	}
+};
+
+// Sets all cubes intersected by triangle
+void voxelize_triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c, ImportCubes& cubes)
+{
+	glm::ivec3 lo(glm::floor(glm::min(a, glm::min(b, c))));
+	glm::ivec3 hi(glm::floor(glm::max(a, glm::max(b, c))));
+	if (lo == hi)
+	{
+		cubes.set(lo);
+		return;
+	}
+	FOR2(x, lo.x, hi.x) FOR2(y, lo.y, hi.y) FOR2(z, lo.z, hi.z)
+	{
+		glm::vec3 center = glm::vec3(x, y, z) + 0.5f;
+		if (triangle_box_overlap(a - center, b - center, c - center, glm::vec3(0.5f))) cubes.set(glm::ivec3(x, y, z));
+	}
+}
+
+struct ImportJob
+{
+	Connection* conn; // null if player disconnected
+	Block block;
+	std::vector<glm::vec3> triangles;
+	ImportCubes cubes;
+	std::atomic<bool> done;
+	std::thread thread;
+	uint applied; // chunks of cubes box visited so far
+	uint chunks; // chunks written to map so far
+	uint blocks; // written to map so far
+	EditRecorder recorder;
+};
+
+static std::vector<ImportJob*> g_import_jobs;
+
+void voxelize_mesh(ImportJob* job)
+{
+	const std::vector<glm::vec3>& v = job->triangles;
+	uint triangles = v.size() / 3;
+	int workers = glm::clamp<int>(std::thread::hardware_concurrency(), 1, MaxImportThreads);
+	std::vector<std::thread> threads;
+	FOR(w, workers) threads.push_back(std::thread([&, w]()
+	{
+		for (uint i = uint64_t(triangles) * w / workers; i < uint64_t(triangles) * (w + 1) / workers; i++)
+		{
+			voxelize_triangle(v[i * 3], v[i * 3 + 1], v[i * 3 + 2], job->cubes);
+		}
+	}));
+	for (std::thread& t : threads) t.join();
+	release(job->triangles);
+	job->done = true;
+}
+
+// Returns error message if import can't start
+const char* server_start_import(Connection& conn, Block block)
+{
+	for (ImportJob* job : g_import_jobs) if (job->conn == &conn) return "previous import still in progress";
+	if (conn.m_edit_jobs.size() >= MaxEditJobs) return "too many edits in progress";
+	if (conn.m_import.size() == 0) return "no valid triangles";
+
+	glm::vec3 lo = conn.m_import[0], hi = conn.m_import[0];
+	for (glm::vec3 v : conn.m_import)
+	{
+		lo = glm::min(lo, v);
+		hi = glm::max(hi, v);
+	}
+	FOR(i, 3) if (hi[i] - lo[i] > MaxImportExtent) return "too large";
+	if (!near_player(conn, glm::i64vec3(glm::floor(lo))) || !near_player(conn, glm::i64vec3(glm::floor(hi)))) return "too far";
+
+	ImportJob* job = new ImportJob;
+	job->conn = &conn;
+	job->block = block;
+	job->triangles.swap(conn.m_import);
+	job->cubes.init(glm::ivec3(glm::floor(lo)), glm::ivec3(glm::floor(hi)));
+	job->done = false;
+	job->applied = 0;
+	job->chunks = 0;
+	job->blocks = 0;
+	fprintf(stderr, "Player #%d importing %u triangles\n", conn.avatar.id, (uint)job->triangles.size() / 3);
+	job->thread = std::thread(voxelize_mesh, job);
+	g_import_jobs.push_back(job);
+	EditJob* edit = new EditJob;
+	edit->import = job;
+	server_queue_edit_job(conn, edit);
+	return nullptr;
+}
+
+// Import of disconnected player is dropped (after its voxelization finishes)
+void server_cancel_imports(Connection* conn)
+{
+	for (ImportJob* job : g_import_jobs) if (job->conn == conn) job->conn = nullptr;
+}
+
+// Writes voxelized import to map, all cubes of a chunk at once. Returns true when done.
+bool server_step_import(Connection& conn, ImportJob* job, uint& budget)
+{
+	if (!job->done) return false;
+	const ImportCubes& cubes = job->cubes;
+	for (; job->applied < cubes.chunks() && budget > 0; job->applied++)
+	{
+		const std::atomic<uint64_t>* words = &cubes.bits[size_t(job->applied) * ChunkWords];
+		bool empty = true;
+		FOR(w, ChunkWords) if (words[w].load(std::memory_order_relaxed)) empty = false;
+		if (empty) continue;
+
+		glm::ivec3 cpos = cubes.cpos(job->applied);
+		Chunk chunk = server_acquire_chunk(cpos);
+		job->recorder.touch(cpos, chunk);
+		FOR(w, ChunkWords)
+		{
+			for (uint64_t word = words[w].load(std::memory_order_relaxed); word; word &= word - 1)
+			{
+				uint j = w * 64 + __builtin_ctzll(word);
+				chunk.set(glm::ivec3(j & ChunkSizeMask, (j >> ChunkSizeBits) & ChunkSizeMask, j >> (2 * ChunkSizeBits)), job->block);
+				job->blocks += 1;
+			}
+		}
+		g_edited_chunks.push_back(cpos);
+		job->chunks += 1;
+		budget -= 1;
+	}
+	if (job->applied < cubes.chunks()) return false;
+
+	job->recorder.commit(conn.m_journal);
+	write_text_message(conn.send_buffer, "import completed: %u blocks in %u chunks", job->blocks, job->chunks);
+	job->thread.join();
+	g_import_jobs.erase(std::find(g_import_jobs.begin(), g_import_jobs.end(), job));
+	delete job;
+	return true;
+}
+
+// Deletes imports of disconnected players once their voxelization finishes
+void server_drop_imports()
+{
+	for (int i = 0; i < g_import_jobs.size(); i++)
+	{
+		ImportJob* job = g_import_jobs[i];
+		if (job->conn || !job->done) continue;
+		job->thread.join();
+		delete job;
+		g_import_jobs[i] = g_import_jobs.back();
+		g_import_jobs.pop_back();
+		i -= 1;
+	}
+}
+
+// Applies pending jobs of all players
+void server_apply_edits()
+{
 	for (Connection* conn : g_connections)
 	{
-		// ISSUE: if distance is >40, but still inside Map then client will skip update to chunk
-		// TODO: ensure robust synchnorization of chunks between client and server.
-		//       client can only change its local Map origin (cpos) when it gets ack from server for its position update.
-		if (glm::distance2(conn->m_cpos, cpos) <= sqr(40/*RenderDistance*/))
+		uint budget = EditChunksPerTick;
+		while (conn->m_edit_jobs.size() > 0)
 		{
-			conn->send_chunk(cpos, chunk);
+			EditJob* job = conn->m_edit_jobs.front();
+			if (job->undo != -1)
+			{
+				server_undo(*conn, job->undo == 1);
+			}
+			else if (job->import)
+			{
+				if (!server_step_import(*conn, job->import, budget)) break;
+			}
+			else
+			{
+				g_recorder = &job->recorder;
+				bool done = server_step_edit_job(*conn, *job, budget);
+				g_recorder = nullptr;
+				if (!done) break;
+				job->recorder.commit(conn->m_journal);
+			}
+			delete job;
+			conn->m_edit_jobs.pop_front();
 		}
 	}
 }
 
+// Imports of player are dropped by server_cancel_imports()
+void server_cancel_edits(Connection* conn)
+{
+	for (EditJob* job : conn->m_edit_jobs) delete job;
+	conn->m_edit_jobs.clear();
+}
+
 int g_simulate = 0;
 
 void server_receive_text_message(Connection& conn, const char* message, uint length)
@@ -714,7 +1623,20 @@ void server_receive_text_message(Connection& conn, const char* message, uint len
 		glm::ivec3 pos(parse_int(tokens[1]), parse_int(tokens[2]), parse_int(tokens[3]));
 		int block = parse_int(tokens[4]);
 		if (block < 0 || block >= block_count) return;
-		server_edit_block(pos, (Block)block);
+		BlockEdit edit;
+		edit.set_position(pos);
+		edit.block = (Block)block;
+		EditJob* job = new EditJob;
+		job->edits.push_back(edit);
+		server_queue_edit_job(conn, job);
+		return;
+	}
+
+	if (tokens[0] == "undo" || tokens[0] == "redo")
+	{
+		EditJob* job = new EditJob;
+		job->undo = (tokens[0] == "redo") ? 1 : 0;
+		server_queue_edit_job(conn, job);
 		return;
 	}
 
@@ -733,6 +1655,10 @@ void server_receive_text_message(Connection& conn, const char* message, uint len
 	}
 }
 
+const float MaxSpawnCoordinate = 1 << 20; // in blocks
+const double MaxInputCredit = 0.5 / PhysicsDt; // steps, to absorb network jitter
+uint8_t g_player_modes = 0; // mode flags granted to new players (see server_main), others are stripped from inputs
+
 bool server_receive_message(Connection& conn)
 {
 	SocketBuffer& recv = conn.recv_buffer;
@@ -746,30 +1672,200 @@ bool server_receive_message(Connection& conn)
 		server_receive_text_message(conn, message->text, message->size);
 		return true;
 	}
-	case MessageType::AvatarState:
+	case MessageType::PlayerSpawn:
 	{
-		auto message = recv.read<MessageAvatarState>();
+		auto message = recv.read<MessagePlayerSpawn>();
 		if (!message) return false;
-		conn.avatar.pitch = message->pitch;
-		conn.avatar.yaw = message->yaw;
-		conn.avatar.position = message->position;
-		conn.avatar.broadcasted = false;
+		ServerAvatar& avatar = conn.avatar;
+		// Only the first spawn (restored from player's save) can place the player, later ones (mode changes) just stop it
+		if (!avatar.spawned)
+		{
+			glm::vec3 p(message->position[0], message->position[1], message->position[2]);
+			bool valid = true;
+			FOR(i, 3) if (!std::isfinite(p[i]) || std::abs(p[i]) > MaxSpawnCoordinate) valid = false;
+			avatar.state.position = valid ? p : glm::vec3(0, 0, 20);
+		}
+		avatar.state.velocity = glm::vec3(0, 0, 0);
+		avatar.state.on_ground = false;
+		avatar.next_seq = message->seq;
+		avatar.spawn_id = message->spawn_id;
+		avatar.position = avatar.state.position;
+		avatar.spawned = true;
+		avatar.ack = true;
+		avatar.input_credit = MaxInputCredit;
+		avatar.input_time = Timestamp();
 		conn.update_cpos();
 		return true;
 	}
+	case MessageType::PlayerInput:
+	{
+		auto message = read_player_input_message(recv);
+		if (!message) return false;
+		ServerAvatar& avatar = conn.avatar;
+		if (!avatar.spawned) return true;
+		if (message->seq != avatar.next_seq)
+		{
+			avatar.seq_errors += 1;
+			if ((avatar.seq_errors & (avatar.seq_errors - 1)) == 0)
+			{
+				fprintf(stderr, "Player #%d input seq %u, expected %u (%u times)\n", avatar.id, message->seq, avatar.next_seq, avatar.seq_errors);
+			}
+			avatar.next_seq = message->seq;
+		}
+
+		// Client can't simulate faster than server clock: steps over credit are skipped (and client is corrected by ack)
+		Timestamp now;
+		avatar.input_credit = std::min(avatar.input_credit + avatar.input_time.elapsed_ms(now) / (PhysicsDt * 1000), MaxInputCredit);
+		avatar.input_time = now;
+		FOR(i, message->count)
+		{
+			PlayerInput input = message->runs[i].input;
+			if ((input.flags & ~(PlayerInput::Jump | avatar.modes)) && !avatar.modes_denied)
+			{
+				write_text_message(conn.send_buffer, "creative mode and disabling collision are not allowed on this server");
+				avatar.modes_denied = true;
+			}
+			input.flags &= PlayerInput::Jump | avatar.modes;
+			FOR(j, message->runs[i].repeat)
+			{
+				if (avatar.input_credit < 1) break;
+				avatar.input_credit -= 1;
+				simulate_player(avatar.state, input, server_is_solid, server_is_water);
+			}
+			avatar.next_seq += message->runs[i].repeat;
+		}
+		avatar.position = avatar.state.position;
+		if (std::isfinite(message->yaw) && std::isfinite(message->pitch))
+		{
+			avatar.yaw = std::fmod(message->yaw, float(2 * M_PI));
+			avatar.pitch = glm::clamp<float>(message->pitch, -M_PI / 2, M_PI / 2);
+		}
+		avatar.ack = true;
+		conn.update_cpos();
+		return true;
+	}
+	case MessageType::MeshTriangles:
+	{
+		auto message = read_mesh_triangles_message(recv);
+		if (!message) return false;
+		FOR(i, message->count)
+		{
+			glm::vec3 v[3]; // vertices in message are unaligned
+			memcpy(v, message->vertices + i * 9, sizeof(v));
+			if (conn.m_import.size() + 3 > MaxImportVertices || !valid_import_triangle(v))
+			{
+				conn.m_import_skipped += 1;
+				continue;
+			}
+			conn.m_import.insert(conn.m_import.end(), v, v + 3);
+		}
+		return true;
+	}
+	case MessageType::MeshImport:
+	{
+		auto message = recv.read<MessageMeshImport>();
+		if (!message) return false;
+		const char* error = ((uint)message->block < block_count) ? server_start_import(conn, message->block) : "invalid block";
+		if (error) write_text_message(conn.send_buffer, "import rejected: %s", error);
+		if (conn.m_import_skipped > 0)
+		{
+			write_text_message(conn.send_buffer, "import: %u triangles skipped (invalid, larger than %g blocks or over limit of %u)", conn.m_import_skipped, MaxTriangleExtent, MaxImportVertices / 3);
+		}
+		release(conn.m_import);
+		conn.m_import_skipped = 0;
+		return true;
+	}
+	case MessageType::EditBatch:
+	{
+		auto message = read_edit_batch_message(recv);
+		if (!message) return false;
+		// whole batch is one undo step
+		EditJob* job = new EditJob;
+		job->edits.assign(message->edits, message->edits + message->edit_count);
+		const RegionEdit* regions = (const RegionEdit*)(message->edits + message->edit_count);
+		job->regions.assign(regions, regions + message->region_count);
+		server_queue_edit_job(conn, job);
+		return true;
+	}
+	case MessageType::AvatarUpdates: FAIL;
+	case MessageType::PlayerAck: FAIL;
 	case MessageType::ChunkState: FAIL;
 	}
 	return false;
 }
 
+// Avatars are replicated only to players within this distance (client render distance)
+const float AvatarViewDistance = 40/*RenderDistance*/ * ChunkSize;
+
+uint32_t g_server_tick = 0;
+
+// Sends changed avatar states to every client in one message per client.
+// Positions are quantized relative to receiver's chunk and far avatars are updated less often.
+void server_replicate_avatars()
+{
+	static std::vector<AvatarUpdate> updates;
+	for (Connection* conn : g_connections)
+	{
+		if (!conn->avatar.spawned) continue;
+		updates.clear();
+		glm::ivec3 origin = conn->m_cpos * ChunkSize * AvatarPositionScale;
+		for (Connection* other : g_connections)
+		{
+			if (other == conn) continue;
+			const ServerAvatar& avatar = other->avatar;
+			Connection::Replica& replica = conn->m_replicas[avatar.id];
+			float dist = glm::distance(conn->avatar.position, avatar.position);
+			if (!avatar.spawned || dist > AvatarViewDistance)
+			{
+				if (replica.visible)
+				{
+					replica.visible = false;
+					conn->m_removed.push_back(avatar.id);
+				}
+				continue;
+			}
+
+			glm::ivec3 position = glm::ivec3(glm::round(avatar.position * float(AvatarPositionScale)));
+			uint16_t orientation = pack_orientation(avatar.yaw, avatar.pitch);
+			if (replica.visible)
+			{
+				if (position == replica.position && orientation == replica.orientation) continue;
+				uint interval = 1u << std::min(3, int(dist / 32)); // in ticks
+				if (g_server_tick - replica.tick < interval) continue;
+			}
+			replica.visible = true;
+			replica.tick = g_server_tick;
+			replica.position = position;
+			replica.orientation = orientation;
+
+			AvatarUpdate update;
+			update.id = avatar.id;
+			FOR(j, 3) update.position[j] = position[j] - origin[j];
+			update.orientation = orientation;
+			updates.push_back(update);
+			if (updates.size() == 255) break;
+		}
+
+		// All removals go out with updates of this tick: removal of reused id must not arrive after its new updates.
+		// There are fewer than 256 ids, and each can be removed at most once per tick.
+		assert(conn->m_removed.size() <= 255);
+		if (updates.size() == 0 && conn->m_removed.size() == 0) continue;
+		write_avatar_updates_message(conn->send_buffer, conn->m_cpos, updates.data(), updates.size(), conn->m_removed.data(), conn->m_removed.size());
+		conn->m_removed.clear();
+	}
+	g_server_tick += 1;
+}
+
 float exchange_time_ms = 0;
 float inbox_time_ms = 0;
 float simulation_time_ms = 0;
 float chunk_time_ms = 0;
 float avatar_time_ms = 0;
 
-void server_main()
+// <player_modes> are PlayerInput mode flags granted to all players
+void server_main(uint8_t player_modes)
 {
+	g_player_modes = player_modes;
 	FOR(i, 255) g_free_ids.push_back(254 - i);
 
 	Socket server_sock;
@@ -791,6 +1887,8 @@ void server_main()
 	mss.type = MessageType::ServerStatus;
 	mss.frame = 0;
 
+	const double BlockTickMs = 10;
+	double block_time_ms = 0;
 	Timestamp ta;
 	while (true)
 	{
@@ -800,7 +1898,16 @@ void server_main()
 			conn->recv_buffer.reserve(1 << 20);
 			// TODO: increase kernel socket recv and send buffer sizes!
 			conn->avatar.id = create_id();
-			conn->avatar.broadcasted = true;
+			conn->avatar.spawned = false;
+			conn->avatar.state = PlayerState();
+			conn->avatar.next_seq = 0;
+			conn->avatar.spawn_id = 0;
+			conn->avatar.ack = false;
+			conn->avatar.seq_errors = 0;
+			conn->avatar.modes = g_player_modes;
+			conn->avatar.modes_denied = false;
+			conn->avatar.yaw = 0;
+			conn->avatar.pitch = 0;
 			fprintf(stderr, "Player #%d connected from %s\n", conn->avatar.id, conn->host);
 			// TODO: send to new player positions of all other avatars (as they may be standing still)
 			for (Connection* conn2 : g_connections)
@@ -821,9 +1928,18 @@ void server_main()
 				fprintf(stderr, "Player #%d disconnected from %s\n", conn->avatar.id, conn->host);
 				for (Connection* conn2 : g_connections)
 				{
-					if (conn != conn2) write_text_message(conn->send_buffer, "left #%d", conn->avatar.id);
+					if (conn == conn2) continue;
+					write_text_message(conn2->send_buffer, "left %d", conn->avatar.id);
+					Connection::Replica& replica = conn2->m_replicas[conn->avatar.id];
+					if (replica.visible)
+					{
+						replica.visible = false;
+						conn2->m_removed.push_back(conn->avatar.id);
+					}
 				}
 				destroy_id(conn->avatar.id);
+				server_cancel_imports(conn);
+				server_cancel_edits(conn);
 				delete conn;
 				g_connections[i] = g_connections.back();
 				g_connections.pop_back();
@@ -842,7 +1958,16 @@ void server_main()
 		}
 
 		Timestamp td;
-		server_simulate_blocks();
+		// Blocks (water, falling sand) keep their 10 ms tick, independent of PhysicsDt loop
+		if (block_time_ms >= BlockTickMs)
+		{
+			block_time_ms = std::min(block_time_ms - BlockTickMs, BlockTickMs);
+			server_simulate_blocks();
+		}
+		server_simulate_bodies();
+		server_apply_edits();
+		server_drop_imports();
+		server_notify_edits();
 
 		// send chunk updates
 		Timestamp te;
@@ -862,23 +1987,23 @@ void server_main()
 			}
 		}
 
-		// broadcast avatar states
+		// acknowledge processed inputs and broadcast avatar states
 		Timestamp tf;
 		for (Connection* conn : g_connections)
 		{
-			if (conn->avatar.broadcasted) continue;
-			MessageAvatarState message;
-			message.type = MessageType::AvatarState;
-			message.id = conn->avatar.id;
-			message.position = conn->avatar.position;
-			message.pitch = conn->avatar.pitch;
-			message.yaw = conn->avatar.yaw;
-			for (Connection* conn2 : g_connections)
-			{
-				if (conn2 != conn) conn2->send_buffer.write(message);
-			}
-			conn->avatar.broadcasted = true;
+			ServerAvatar& avatar = conn->avatar;
+			if (!avatar.ack) continue;
+			MessagePlayerAck message;
+			message.type = MessageType::PlayerAck;
+			message.spawn_id = avatar.spawn_id;
+			message.seq = avatar.next_seq;
+			FOR(i, 3) message.position[i] = avatar.state.position[i];
+			FOR(i, 3) message.velocity[i] = avatar.state.velocity[i];
+			message.on_ground = avatar.state.on_ground;
+			conn->send_buffer.write(message);
+			avatar.ack = false;
 		}
+		server_replicate_avatars();
 		Timestamp tg;
 
 		exchange_time_ms   = glm::mix<float>(exchange_time_ms,   tb.elapsed_ms(tc), 0.15f);
@@ -897,7 +2022,8 @@ void server_main()
 
 		Timestamp tx;
 		double ft = ta.elapsed_ms(tx);
-		if (ft < 10) usleep(int((10 - ft) * 1000));
+		if (ft < PhysicsDt * 1000) usleep(int((PhysicsDt * 1000 - ft) * 1000));
+		block_time_ms += ft;
 		ta = tx;
 	}
 }
@@ -1,30 +1,65 @@
 #version 150
 
-uniform int tick;
 uniform vec3 eye;
 uniform mat4 matrix;
+#ifndef BATCHED
 uniform ivec3 cpos;
+#endif
 
-in ivec3 vertex0;
-in ivec3 vertex1;
-in ivec3 vertex2;
-in ivec3 vertex3;
-in int block_texture_with_flag;
-in int light;
-in int plane;
+#ifdef PULL
+// Vertex pulling variant: drawn as instanced triangle strips (4 vertices per quad), without geometry shader.
+uniform usamplerBuffer quads;
+uniform int quad_base;
+uniform float foglimit2;
 
-out ivec3 g_vertex[4];
-out int g_block_texture_with_flag;
-out int g_light;
-out int g_plane;
+out float fog_factor;
+out float fragment_light;
+out vec2 fragment_uv;
+out float fragment_texture;
+out float fragment_underwater_texture;
 
 void main()
 {
-	g_vertex[0] = vertex0;
-	g_vertex[1] = vertex1;
-	g_vertex[2] = vertex2;
-	g_vertex[3] = vertex3;
-	g_block_texture_with_flag = block_texture_with_flag;
-	g_light = light;
-	g_plane = plane;
+	uvec2 quad = texelFetch(quads, quad_base + gl_InstanceID).xy;
+	int block_texture = quad_texture(quad.x);
+	fragment_texture = transform_texture(block_texture);
+	fragment_underwater_texture = quad_underwater_texture(quad.x);
+
+	ivec3 pos;
+	int light;
+	ivec2 uv;
+	quad_vertex(quad.x, quad.y, gl_VertexID, pos, light, uv);
+
+	vec3 p = cpos + pos / 15.0f;
+	if (block_texture <= 5) p = leaf_transform(p);
+
+	gl_Position = matrix * vec4(p, 1);
+	fragment_uv = uv / 15.0f;
+	fragment_light = (light + 1) / 256.0f;
+
+	float eye_dist_sqr = dot(eye - p, eye - p);
+	fog_factor = clamp(eye_dist_sqr / foglimit2, 0.0, 1.0);
+	fog_factor *= fog_factor;
+}
+#else
+in uint word0;
+in uint word1;
+#ifdef BATCHED
+in int draw_id;
+#endif
+
+out uint g_word0;
+out uint g_word1;
+#ifdef BATCHED
+out int g_draw_id;
+#endif
+
+void main()
+{
+	g_word0 = word0;
+	g_word1 = word1;
+#ifdef BATCHED
+	g_draw_id = draw_id;
+#endif
 }
+#endif
@@ -0,0 +1,115 @@
+// Expansion of packed block quads (see struct Quad in main.cc) into triangle strips, shared by block.geom and block.vert
+// (PULL). Prepended to block shaders by BlockProgram::load() after the #version line.
+
+uniform int tick;
+
+const float pi = 3.14159265f;
+
+const int faces[24] = int[24](0, 4, 6, 2,  1, 3, 7, 5,  0, 1, 5, 4,  2, 6, 7, 3,  0, 2, 3, 1,  4, 5, 7, 6);
+
+vec3 leaf_transform(vec3 p)
+{
+	// TODO All of these should be moved to uniform vars
+	float ftick = tick * 0.4;
+	float speed = 0.75;
+	float magnitude = (sin((ftick * pi / ((28.0) * speed))) * 0.05 + 0.15)*0.2;
+	float d0 = sin(ftick * pi / (122.0 * speed)) * 3.0 - 1.5;
+	float d1 = sin(ftick * pi / (142.0 * speed)) * 3.0 - 1.5;
+	float d2 = sin(ftick * pi / (162.0 * speed)) * 3.0 - 1.5;
+	float d3 = sin(ftick * pi / (112.0 * speed)) * 3.0 - 1.5;
+
+	p.x += sin((ftick * pi / (13.0 * speed)) + (p.x + d0)*0.9 + (p.z + d1)*0.9) * magnitude;
+	p.z += sin((ftick * pi / (16.0 * speed)) + (p.z + d2)*0.9 + (p.x + d3)*0.9) * magnitude;
+	// p.y += sin((ftick * pi / (15.0 * speed)) + (p.z + d2) + (p.x + d3)) * magnitude;
+	return p;
+}
+
+int transform_texture(int block_texture)
+{
+	if (block_texture == 6 || block_texture == 38) // lava_flow / lava_still
+	{
+		return block_texture + ((tick / 8) % 32);
+	}
+	if (block_texture == 70) // water_still
+	{
+		return block_texture + ((tick / 8) % 64);
+	}
+	if (block_texture == 134) // pumpkin_face
+	{
+		return block_texture + ((tick / 40) % 2);
+	}
+	if (block_texture == 136) // furnace_front_on
+	{
+		return block_texture + ((tick / 10) % 16);
+	}
+	if (block_texture == 152) // sea_lantern
+	{
+		return block_texture + ((tick / 20) % 5);
+	}
+	if (block_texture == 157 || block_texture == 159) // redstone_lamp
+	{
+		return block_texture + ((tick / 40) % 2);
+	}
+	if (block_texture == 161) // water_flow
+	{
+		return block_texture + ((tick / 8) % 32);
+	}
+	return block_texture;
+}
+
+// word0: light 16 | texture 10 | underwater 1 | face 3
+// word1: plane offset 8 | u0 4 | v0 4 | w-1 4 | h-1 4 | vlo 4 | vhi 4
+
+int quad_texture(uint word0)
+{
+	return int(word0 >> 16) & 1023;
+}
+
+float quad_underwater_texture(uint word0)
+{
+	return ((word0 & (1u << 26)) != 0u) ? 70 + ((tick / 8) % 64) : -1.f;
+}
+
+// Corner <i> of quad, in 1/15 of block relative to chunk origin
+ivec3 quad_corner(uint word0, uint word1, int i)
+{
+	int face = int(word0 >> 27);
+	int axis = face / 2;
+	int ua = (axis == 0) ? 1 : 0;
+	int va = (axis == 2) ? 1 : 2;
+	int u0 = int(word1 >> 8) & 15, v0 = int(word1 >> 12) & 15;
+	int w = (int(word1 >> 16) & 15) + 1, h = (int(word1 >> 20) & 15) + 1;
+	int vlo = int(word1 >> 24) & 15, vhi = int(word1 >> 28) & 15;
+
+	int c = faces[face * 4 + i];
+	ivec3 bits = ivec3(c & 1, (c >> 1) & 1, (c >> 2) & 1);
+	ivec3 p;
+	p[axis] = int(word1) & 255;
+	p[ua] = (u0 + bits[ua] * w) * 15;
+	p[va] = (bits[va] != 0) ? (v0 + h) * 15 - 15 + vhi : v0 * 15 + vlo;
+	return p;
+}
+
+// Vertex <k> (0 to 3) of quad's triangle strip
+void quad_vertex(uint word0, uint word1, int k, out ivec3 pos, out int light, out ivec2 uv)
+{
+	int face = int(word0 >> 27);
+	ivec3 d = quad_corner(word0, word1, 2) - quad_corner(word0, word1, 0);
+	int u, v;
+	if (face < 2) { u = d.y; v = d.z; }
+	else if (face < 4) { u = d.x; v = d.z; }
+	else { u = d.y; v = d.x; }
+
+	// How much to rotate the quad?
+	int a = (face == 0 || face == 3 || face == 5) ? 0 : 1;
+
+	// Diagonal of strip depends on light of the other two corners
+	int light1 = int(word0 >> (((1 + a) % 4) * 4)) & 15;
+	int light3 = int(word0 >> (((3 + a) % 4) * 4)) & 15;
+	const int order[8] = int[8](0, 1, 3, 2,  3, 0, 2, 1);
+	int j = order[((light1 != light3) ? 4 : 0) + k];
+
+	pos = quad_corner(word0, word1, (j + a) % 4);
+	light = ((int(word0 >> (((j + a) % 4) * 4)) & 15) + 1) * 16 - 1;
+	uv = ivec2((j < 2) ? u : 0, (j == 0 || j == 3) ? v : 0);
+}
@@ -5,13 +5,14 @@ uniform vec3 eye;
 uniform mat4 matrix;
 uniform float foglimit2;
 
-uniform vec3 mesh_pos;
-uniform mat3 mesh_rot;
-
 in vec3 vertex_pos;
 in vec2 vertex_uv;
 in int texture_with_flag;
 
+// per instance
+in vec3 mesh_pos;
+in mat3 mesh_rot;
+
 out float fog_factor;
 out vec2 fragment_uv;
 out float fragment_texture;
@@ -4,10 +4,16 @@ uniform mat4 matrix;
 
 in vec4 position;
 in vec2 uv;
+in vec4 fg_color;
+in vec4 bg_color;
 
 out vec2 fragment_uv;
+flat out vec4 fragment_fg_color;
+flat out vec4 fragment_bg_color;
 
 void main() {
     gl_Position = matrix * position;
     fragment_uv = uv;
+    fragment_fg_color = fg_color;
+    fragment_bg_color = bg_color;
 }